@@ -0,0 +1,308 @@
+//
+// fat16fuse: mounts a FAT16 image read-only through FUSE.
+//
+// usage: fat16fuse <image_file> <mountpoint> [fuse options]
+// build: cc -o fat16fuse fat16fuse.c file_reader.c $(pkg-config --cflags --libs fuse3)
+//
+// The image never changes while mounted, so entries, attributes and file pages are cached by
+// the kernel for a long time and most reads never reach this process.
+//
+
+#define FUSE_USE_VERSION 31
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include "file_reader.h"
+
+#define CACHE_TIMEOUT 86400.0
+#define ROOT_INODE 1
+
+struct mount_t {
+    struct disk_t *disk;
+    struct volume_t *volume;
+    uint32_t free_clusters;
+    time_t mount_time;
+    pthread_mutex_t lock; //disk_t shares one FILE position, so disk access is serialized
+};
+
+struct mount_t *get_mount(void) {
+    return (struct mount_t *) fuse_get_context()->private_data;
+}
+
+//First cluster when there is one; empty files have none, so their directory slot is used instead
+ino_t make_inode(const struct dir_entry_t *entry) {
+
+    if (entry->first_cluster != 0) {
+        return entry->first_cluster;
+    }
+
+    return 0x10000 + entry->address / sizeof(struct SFN);
+}
+
+time_t make_time(struct date_t date, struct my_time_t time) {
+
+    struct tm local;
+    memset(&local, 0, sizeof(struct tm));
+    local.tm_year = date.year + 80;
+    local.tm_mon = date.month > 0 ? date.month - 1 : 0;
+    local.tm_mday = date.day > 0 ? date.day : 1;
+    local.tm_hour = time.hours;
+    local.tm_min = time.minutes;
+    local.tm_sec = time.seconds * 2;
+    local.tm_isdst = -1;
+
+    return mktime(&local);
+}
+
+void fill_stat(struct stat *stbuf, const struct dir_entry_t *entry, uint32_t cluster_size) {
+
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = make_inode(entry);
+    if (entry->is_directory) {
+        stbuf->st_mode = S_IFDIR | 0555;
+        stbuf->st_nlink = 2;
+    } else {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = entry->size;
+    }
+    stbuf->st_blksize = cluster_size;
+    stbuf->st_blocks = ((entry->size + cluster_size - 1) / cluster_size) * (cluster_size / 512);
+    stbuf->st_mtime = make_time(entry->modified_date, entry->modified_time);
+    stbuf->st_ctime = stbuf->st_mtime;
+    stbuf->st_atime = stbuf->st_mtime;
+}
+
+void *fs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    (void) conn;
+
+    cfg->use_ino = 1;
+    cfg->kernel_cache = 1;
+    cfg->entry_timeout = CACHE_TIMEOUT;
+    cfg->attr_timeout = CACHE_TIMEOUT;
+    cfg->negative_timeout = CACHE_TIMEOUT;
+
+    return get_mount();
+}
+
+int fs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+    (void) fi;
+
+    struct mount_t *mount = get_mount();
+    uint32_t cluster_size = mount->volume->boot_sector->bytes_per_sector *
+                            mount->volume->boot_sector->sectors_per_clusters;
+
+    if (strcmp(path, "/") == 0) {
+        memset(stbuf, 0, sizeof(struct stat));
+        stbuf->st_ino = ROOT_INODE;
+        stbuf->st_mode = S_IFDIR | 0555;
+        stbuf->st_nlink = 2;
+        stbuf->st_blksize = cluster_size;
+        stbuf->st_mtime = mount->mount_time;
+        stbuf->st_ctime = mount->mount_time;
+        stbuf->st_atime = mount->mount_time;
+        return 0;
+    }
+
+    uint16_t dir_cluster;
+    char sfn_name[11];
+    struct SFN entry;
+    uint32_t address;
+
+    pthread_mutex_lock(&mount->lock);
+    int error = lookup_path(mount->volume, path, &dir_cluster, sfn_name, &entry, &address);
+    int saved_errno = errno;
+    pthread_mutex_unlock(&mount->lock);
+
+    if (error == 1) {
+        return -ENOENT;
+    }
+    if (error != 0) {
+        return saved_errno == EINVAL ? -ENOENT : -saved_errno;
+    }
+
+    struct dir_entry_t info;
+    make_dir_entry(mount->volume, &entry, address, &info);
+    fill_stat(stbuf, &info, cluster_size);
+    return 0;
+}
+
+int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi,
+               enum fuse_readdir_flags flags) {
+    (void) offset;
+    (void) fi;
+
+    struct mount_t *mount = get_mount();
+    uint32_t cluster_size = mount->volume->boot_sector->bytes_per_sector *
+                            mount->volume->boot_sector->sectors_per_clusters;
+
+    pthread_mutex_lock(&mount->lock);
+    struct dir_t *dir = dir_open(mount->volume, strcmp(path, "/") == 0 ? "\\" : path);
+    int saved_errno = errno;
+    pthread_mutex_unlock(&mount->lock);
+
+    if (dir == NULL) {
+        return -saved_errno;
+    }
+
+    filler(buf, ".", NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+
+    //Without FUSE_FILL_DIR_PLUS only the inode and type are used; with it (when the kernel asked for
+    //READDIR_PLUS) the whole stat is kept, the same one getattr gives, and the lookups are skipped
+    enum fuse_fill_dir_flags fill_flags = (flags & FUSE_READDIR_PLUS) ? FUSE_FILL_DIR_PLUS : 0;
+    struct dir_entry_t entry;
+    struct stat stbuf;
+    while (dir_read(dir, &entry) == 0) {
+        if (strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0) {
+            continue;
+        }
+        fill_stat(&stbuf, &entry, cluster_size);
+        if (filler(buf, entry.name, &stbuf, 0, fill_flags) != 0) {
+            break;
+        }
+    }
+
+    dir_close(dir);
+    return 0;
+}
+
+int fs_open(const char *path, struct fuse_file_info *fi) {
+
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        return -EROFS;
+    }
+
+    struct mount_t *mount = get_mount();
+
+    pthread_mutex_lock(&mount->lock);
+    struct file_t *stream = file_open_path(mount->volume, path);
+    int saved_errno = errno;
+    pthread_mutex_unlock(&mount->lock);
+
+    if (stream == NULL) {
+        return -saved_errno;
+    }
+
+    //Each open gets its own file_t, and reads go through file_pread, so no seek state is shared
+    fi->fh = (uint64_t) (uintptr_t) stream;
+    fi->keep_cache = 1;
+
+    return 0;
+}
+
+int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    (void) path;
+
+    struct mount_t *mount = get_mount();
+    struct file_t *stream = (struct file_t *) (uintptr_t) fi->fh;
+
+    if (offset < 0 || (uint64_t) offset >= stream->file.size) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&mount->lock);
+    size_t result = file_pread(buf, size, (uint32_t) offset, stream);
+    int saved_errno = errno;
+    pthread_mutex_unlock(&mount->lock);
+
+    if (result == (size_t) -1) {
+        return -saved_errno;
+    }
+
+    return (int) result;
+}
+
+int fs_release(const char *path, struct fuse_file_info *fi) {
+    (void) path;
+
+    file_close((struct file_t *) (uintptr_t) fi->fh);
+
+    return 0;
+}
+
+int fs_statfs(const char *path, struct statvfs *stbuf) {
+    (void) path;
+
+    struct mount_t *mount = get_mount();
+
+    memset(stbuf, 0, sizeof(struct statvfs));
+    stbuf->f_bsize = mount->volume->boot_sector->bytes_per_sector * mount->volume->boot_sector->sectors_per_clusters;
+    stbuf->f_frsize = stbuf->f_bsize;
+    stbuf->f_blocks = get_cluster_count(mount->volume);
+    stbuf->f_bfree = mount->free_clusters;
+    stbuf->f_bavail = mount->free_clusters;
+    stbuf->f_namemax = 12;
+    stbuf->f_flag = ST_RDONLY;
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <image_file> <mountpoint> [fuse options]\n", argv[0]);
+        return 1;
+    }
+
+    struct mount_t mount;
+    memset(&mount, 0, sizeof(struct mount_t));
+
+    mount.disk = disk_open_from_file(argv[1]);
+    if (mount.disk == NULL) {
+        fprintf(stderr, "%s: %s: %s\n", argv[0], argv[1], strerror(errno));
+        return 1;
+    }
+    mount.volume = fat_open(mount.disk, 0);
+    if (mount.volume == NULL) {
+        fprintf(stderr, "%s: %s: not a FAT16 volume\n", argv[0], argv[1]);
+        disk_close(mount.disk);
+        return 1;
+    }
+    mount.mount_time = time(NULL);
+    pthread_mutex_init(&mount.lock, NULL);
+
+    uint16_t *fat = (uint16_t *) mount.volume->fat1;
+    uint32_t end = get_cluster_count(mount.volume) + 2;
+    for (uint32_t cluster = 2; cluster < end; ++cluster) {
+        if (fat[cluster] == 0) {
+            ++mount.free_clusters;
+        }
+    }
+
+    struct fuse_operations operations;
+    memset(&operations, 0, sizeof(struct fuse_operations));
+    operations.init = fs_init;
+    operations.getattr = fs_getattr;
+    operations.readdir = fs_readdir;
+    operations.open = fs_open;
+    operations.read = fs_read;
+    operations.release = fs_release;
+    operations.statfs = fs_statfs;
+
+    //Drop the image argument and force a read-only mount
+    struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+    fuse_opt_add_arg(&args, argv[0]);
+    for (int i = 2; i < argc; ++i) {
+        fuse_opt_add_arg(&args, argv[i]);
+    }
+    fuse_opt_add_arg(&args, "-oro");
+
+    int result = fuse_main(args.argc, args.argv, &operations, &mount);
+
+    fuse_opt_free_args(&args);
+    pthread_mutex_destroy(&mount.lock);
+    fat_close(mount.volume);
+    disk_close(mount.disk);
+
+    return result;
+}
@@ -0,0 +1,138 @@
+//
+// fat16pack: converts a raw image into the chunked compressed format read by disk_open_from_file.
+//
+// usage: fat16pack [-c chunk_size_in_KiB] <raw_image> <packed_image>
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "file_reader.h"
+
+#define OUTPUT_BUFFER_SIZE (4 * 1024 * 1024)
+
+int is_zero(const uint8_t *data, size_t size) {
+
+    for (size_t i = 0; i < size; ++i) {
+        if (data[i] != 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int main(int argc, char **argv) {
+
+    uint32_t chunk_size = COMPRESSED_CHUNK_SIZE;
+    int option;
+
+    while ((option = getopt(argc, argv, "c:")) != -1) {
+        switch (option) {
+            case 'c':
+                chunk_size = (uint32_t) strtoul(optarg, NULL, 10) * 1024;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-c chunk_size_in_KiB] <raw_image> <packed_image>\n", argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 2 || chunk_size == 0 || chunk_size > 16 * 1024 * 1024) {
+        fprintf(stderr, "usage: %s [-c chunk_size_in_KiB] <raw_image> <packed_image>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(argv[optind], "rb");
+    if (in == NULL) {
+        fprintf(stderr, "fat16pack: %s: %s\n", argv[optind], strerror(errno));
+        return 2;
+    }
+    if (fseeko(in, 0, SEEK_END) != 0) {
+        fclose(in);
+        return 2;
+    }
+    uint64_t image_size = (uint64_t) ftello(in);
+    rewind(in);
+
+    struct compressed_header_t header;
+    memset(&header, 0, sizeof(struct compressed_header_t));
+    memcpy(header.magic, COMPRESSED_MAGIC, sizeof(header.magic));
+    header.chunk_size = chunk_size;
+    header.chunk_count = (uint32_t) ((image_size + chunk_size - 1) / chunk_size);
+    header.image_size = image_size;
+
+    struct chunk_index_t *index = calloc(header.chunk_count > 0 ? header.chunk_count : 1,
+                                         sizeof(struct chunk_index_t));
+    uint8_t *chunk = malloc(chunk_size);
+    uint8_t *encoded = malloc(chunk_size);
+    FILE *out = fopen(argv[optind + 1], "wb");
+    if (index == NULL || chunk == NULL || encoded == NULL || out == NULL) {
+        fprintf(stderr, "fat16pack: %s\n", strerror(errno));
+        return 2;
+    }
+    setvbuf(out, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+
+    int error = fwrite(&header, sizeof(struct compressed_header_t), 1, out) != 1;
+    uint64_t offset = sizeof(struct compressed_header_t);
+    uint32_t zero_chunks = 0;
+
+    for (uint32_t i = 0; i < header.chunk_count && !error; ++i) {
+        size_t length = image_size - (uint64_t) i * chunk_size < chunk_size ?
+                        (size_t) (image_size - (uint64_t) i * chunk_size) : chunk_size;
+        if (fread(chunk, 1, length, in) != length) {
+            error = 1;
+            break;
+        }
+
+        index[i].offset = offset;
+        if (is_zero(chunk, length)) {
+            index[i].codec = CHUNK_ZERO;
+            ++zero_chunks;
+            continue;
+        }
+
+        size_t encoded_size = rle_encode(chunk, length, encoded, length - 1);
+        const uint8_t *stored = encoded;
+        if (encoded_size == 0) {
+            index[i].codec = CHUNK_RAW;
+            encoded_size = length;
+            stored = chunk;
+        } else {
+            index[i].codec = CHUNK_RLE;
+        }
+
+        index[i].stored_size = (uint32_t) encoded_size;
+        if (fwrite(stored, 1, encoded_size, out) != encoded_size) {
+            error = 1;
+        }
+        offset += encoded_size;
+    }
+
+    header.index_offset = offset;
+    if (!error && (fwrite(index, sizeof(struct chunk_index_t), header.chunk_count, out) != header.chunk_count ||
+                   fseeko(out, 0, SEEK_SET) != 0 ||
+                   fwrite(&header, sizeof(struct compressed_header_t), 1, out) != 1)) {
+        error = 1;
+    }
+    if (fclose(out) != 0) {
+        error = 1;
+    }
+    fclose(in);
+
+    if (error) {
+        fprintf(stderr, "fat16pack: failed converting %s\n", argv[optind]);
+    } else {
+        printf("%s: %" PRIu32 " chunks (%" PRIu32 " zero), %" PRIu64 " -> %" PRIu64 " bytes\n",
+               argv[optind + 1], header.chunk_count, zero_chunks, image_size,
+               offset + (uint64_t) header.chunk_count * sizeof(struct chunk_index_t));
+    }
+
+    free(index);
+    free(chunk);
+    free(encoded);
+
+    return error ? 2 : 0;
+}
@@ -8,6 +8,8 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include <string.h>
+#include <ctype.h>
+#include <unistd.h>
 #include "tested_declarations.h"
 #include "rdebug.h"
 #include "tested_declarations.h"
@@ -31,6 +33,47 @@ struct disk_t *disk_open_from_file(const char *volume_file_name) {
         return NULL;
     }
 
+    char magic[8];
+    if (fread(magic, sizeof(magic), 1, disk->f) == 1 && memcmp(magic, COMPRESSED_MAGIC, sizeof(magic)) == 0) {
+        if (compressed_open(disk) != 0) {
+            fclose(disk->f);
+            free(disk);
+            return NULL;
+        }
+    }
+    rewind(disk->f);
+
+    return disk;
+}
+
+struct disk_t *disk_open_from_file_rw(const char *volume_file_name) {
+    if (volume_file_name == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+
+    struct disk_t *disk = calloc(1, sizeof(struct disk_t));
+    if (disk == NULL) {
+        return NULL;
+    }
+
+    disk->f = fopen(volume_file_name, "r+b");
+    if (disk->f == NULL) {
+        free(disk);
+        return NULL;
+    }
+
+    //Compressed images are read-only
+    char magic[8];
+    if (fread(magic, sizeof(magic), 1, disk->f) == 1 && memcmp(magic, COMPRESSED_MAGIC, sizeof(magic)) == 0) {
+        fclose(disk->f);
+        free(disk);
+        errno = EROFS;
+        return NULL;
+    }
+    rewind(disk->f);
+    disk->is_writable = 1;
+
     return disk;
 }
 
@@ -45,12 +88,32 @@ int disk_close(struct disk_t *pdisk) {
         return -1;
     }
 
+    if (pdisk->compressed != NULL) {
+        compressed_close(pdisk);
+    }
     fclose(pdisk->f);
     free(pdisk);
 
     return 0;
 }
 
+int disk_sync(struct disk_t *pdisk) {
+
+    if (pdisk == NULL || pdisk->f == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (!pdisk->is_writable) {
+        return 0;
+    }
+
+    if (fflush(pdisk->f) != 0 || fsync(fileno(pdisk->f)) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
 int disk_read(struct disk_t *pdisk, int32_t first_sector, void *buffer, int32_t sectors_to_read) {
 
     if (pdisk == NULL || buffer == NULL || sectors_to_read <= 0) {
@@ -62,6 +125,10 @@ int disk_read(struct disk_t *pdisk, int32_t first_sector, void *buffer, int32_t
         return -1;
     }
 
+    if (pdisk->compressed != NULL) {
+        return compressed_read(pdisk, first_sector, buffer, sectors_to_read);
+    }
+
     uint8_t *temp = (uint8_t *) buffer;
 
     if (first_sector != -1) {
@@ -77,6 +144,34 @@ int disk_read(struct disk_t *pdisk, int32_t first_sector, void *buffer, int32_t
     return sectors_to_read;
 }
 
+int disk_write(struct disk_t *pdisk, int32_t first_sector, const void *buffer, int32_t sectors_to_write) {
+
+    if (pdisk == NULL || buffer == NULL || sectors_to_write <= 0) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (pdisk->f == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (!pdisk->is_writable) {
+        errno = EROFS;
+        return -1;
+    }
+
+    if (first_sector != -1) {
+        fseek(pdisk->f, first_sector, SEEK_SET);
+    }
+
+    int32_t result = (int32_t) fwrite(buffer, 512, sectors_to_write, pdisk->f);
+    if (result != sectors_to_write) {
+        errno = EIO;
+        return -1;
+    }
+
+    return sectors_to_write;
+}
+
 struct volume_t *fat_open(struct disk_t *pdisk, uint32_t first_sector) {
 
     if (pdisk == NULL) {
@@ -147,14 +242,25 @@ struct volume_t *fat_open(struct disk_t *pdisk, uint32_t first_sector) {
         return NULL;
     }
 
-    if (memcmp(result->fat1, result->fat2, result->boot_sector->size_of_fat * result->boot_sector->bytes_per_sector) !=
-        0) {
-        free(result->boot_sector);
-        free(result->fat1);
-        free(result->fat2);
-        free(result);
-        errno = EINVAL;
-        return NULL;
+    //The copies are written one after the other, so a crash in between leaves them different; FAT1 goes
+    //first and is the one trusted, and on a writable disk the sectors that differ are rewritten on the next flush
+    result->fat_dirty_first = -1;
+    result->fat_dirty_last = -1;
+    for (int32_t sector = 0; sector < result->boot_sector->size_of_fat; ++sector) {
+        size_t offset = (size_t) sector * result->boot_sector->bytes_per_sector;
+        if (memcmp(result->fat1 + offset, result->fat2 + offset, result->boot_sector->bytes_per_sector) != 0) {
+            if (result->fat_dirty_first == -1) {
+                result->fat_dirty_first = sector;
+            }
+            result->fat_dirty_last = sector;
+        }
+    }
+    if (result->fat_dirty_first != -1) {
+        memcpy(result->fat2, result->fat1, result->boot_sector->size_of_fat * result->boot_sector->bytes_per_sector);
+        if (!pdisk->is_writable) {
+            result->fat_dirty_first = -1;
+            result->fat_dirty_last = -1;
+        }
     }
 
     result->root = calloc(result->boot_sector->maximum_number_of_files, sizeof(struct SFN));
@@ -187,6 +293,11 @@ int fat_close(struct volume_t *pvolume) {
         return -1;
     }
 
+    int error = 0;
+    if (pvolume->dirty_count > 0 || pvolume->fat_dirty_first != -1) {
+        error = volume_sync(pvolume);
+    }
+
     if (pvolume->boot_sector != NULL)
         free(pvolume->boot_sector);
     if (pvolume->fat1 != NULL)
@@ -195,10 +306,14 @@ int fat_close(struct volume_t *pvolume) {
         free(pvolume->fat2);
     if (pvolume->root != NULL)
         free(pvolume->root);
+    if (pvolume->free_map != NULL)
+        free(pvolume->free_map);
+    if (pvolume->dirty != NULL)
+        free(pvolume->dirty);
 
     free(pvolume);
 
-    return 0;
+    return error;
 }
 
 struct file_t *file_open(struct volume_t *pvolume, const char *file_name) {
@@ -207,6 +322,10 @@ struct file_t *file_open(struct volume_t *pvolume, const char *file_name) {
         return NULL;
     }
 
+    if (strchr(file_name, '\\') != NULL || strchr(file_name, '/') != NULL) {
+        return file_open_path(pvolume, file_name);
+    }
+
     int file_pos = find_file(pvolume, file_name);
     if (file_pos == -1) {
         errno = ENOENT;
@@ -230,6 +349,7 @@ struct file_t *file_open(struct volume_t *pvolume, const char *file_name) {
     result->bytes_per_sector = pvolume->boot_sector->bytes_per_sector;
     result->sectors_per_clusters = pvolume->boot_sector->sectors_per_clusters;
     result->volume = pvolume;
+    result->entry_address = get_root_start(pvolume) * 512 + file_pos * sizeof(struct SFN);
 
     return result;
 }
@@ -283,6 +403,10 @@ int file_close(struct file_t *stream) {
         return -1;
     }
 
+    if (stream->chain != NULL) {
+        free(stream->chain->clusters);
+        free(stream->chain);
+    }
     free(stream);
 
     return 0;
@@ -362,12 +486,16 @@ size_t file_read(void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
             stream->volume->boot_sector->maximum_number_of_files * sizeof(struct SFN) / 512;//root
 
     uint16_t fat_sector = stream->file.low_order_address_of_first_cluster;
+    size_t chain_pos = 0;
+    if (stream->chain != NULL && stream->chain->size > 0) {
+        fat_sector = stream->chain->clusters[0];
+    }
 
     while (total) {
 
         address = (data_start + (fat_sector - 2) * stream->volume->boot_sector->sectors_per_clusters);
 
-        error = disk_read(stream->volume->disk, address * 512, buffer, stream->sectors_per_clusters);
+        error = volume_read(stream->volume, address, buffer, stream->sectors_per_clusters);
         if (error != stream->sectors_per_clusters) {
             free(buffer);
             return -1;
@@ -397,6 +525,15 @@ size_t file_read(void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
 
         }
 
+        if (stream->chain != NULL) {
+            ++chain_pos;
+            if (chain_pos >= stream->chain->size) {
+                break;
+            }
+            fat_sector = stream->chain->clusters[chain_pos];
+            continue;
+        }
+
         if (*((uint16_t *) (stream->volume->fat1) + fat_sector) >= 0xFFF8) {
             break;
         }
@@ -411,6 +548,114 @@ size_t file_read(void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
     return to_return;
 }
 
+size_t file_pread(void *ptr, size_t size, uint32_t offset, const struct file_t *stream) {
+
+    if (ptr == NULL || stream == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (offset >= stream->file.size || size == 0) {
+        return 0;
+    }
+    if (size > stream->file.size - offset) {
+        size = stream->file.size - offset;
+    }
+
+    struct volume_t *volume = stream->volume;
+    uint16_t *fat = (uint16_t *) volume->fat1;
+    uint32_t cluster_size = stream->bytes_per_sector * stream->sectors_per_clusters;
+    uint32_t end = get_cluster_count(volume) + 2;
+    size_t chain_pos = offset / cluster_size;
+    uint16_t cluster;
+
+    //Only the FAT (in memory) is walked to reach the first cluster; no data before offset is read
+    if (stream->chain != NULL) {
+        if (chain_pos >= stream->chain->size) {
+            errno = EIO;
+            return -1;
+        }
+        cluster = stream->chain->clusters[chain_pos];
+    } else {
+        cluster = stream->file.low_order_address_of_first_cluster;
+        for (size_t i = 0; i < chain_pos; ++i) {
+            if (cluster < 2 || cluster >= end || fat[cluster] >= 0xFFF8) {
+                errno = EIO;
+                return -1;
+            }
+            cluster = fat[cluster];
+        }
+    }
+
+    char *buffer = NULL;
+    char *dest = (char *) ptr;
+    size_t remaining = size;
+
+    while (remaining > 0) {
+        if (cluster < 2 || cluster >= end) {
+            free(buffer);
+            errno = EIO;
+            return -1;
+        }
+
+        uint32_t inner = offset % cluster_size;
+        size_t count = cluster_size - inner;
+        if (count > remaining) {
+            count = remaining;
+        }
+
+        if (inner == 0 && count == cluster_size) {
+            //Adjacent clusters fully covered by the request are fetched with one read
+            size_t run = 1;
+            uint16_t last = cluster;
+            while (remaining >= (run + 1) * cluster_size) {
+                uint16_t next = stream->chain != NULL ?
+                                (chain_pos + run < stream->chain->size ? stream->chain->clusters[chain_pos + run] : 0) :
+                                fat[last];
+                if (next != last + 1) {
+                    break;
+                }
+                last = next;
+                ++run;
+            }
+            int32_t sectors = (int32_t) (run * stream->sectors_per_clusters);
+            if (volume_read(volume, get_data_start(volume) + (cluster - 2) * stream->sectors_per_clusters, dest,
+                            sectors) != sectors) {
+                free(buffer);
+                return -1;
+            }
+            count = run * cluster_size;
+            chain_pos += run - 1;
+            cluster = last;
+        } else {
+            if (buffer == NULL && (buffer = malloc(cluster_size)) == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            if (read_cluster(volume, cluster, buffer) != 0) {
+                free(buffer);
+                return -1;
+            }
+            memcpy(dest, buffer + inner, count);
+        }
+
+        dest += count;
+        offset += count;
+        remaining -= count;
+
+        if (remaining > 0) {
+            ++chain_pos;
+            if (stream->chain != NULL) {
+                cluster = chain_pos < stream->chain->size ? stream->chain->clusters[chain_pos] : 0;
+            } else {
+                cluster = fat[cluster] < 0xFFF8 ? fat[cluster] : 0;
+            }
+        }
+    }
+
+    free(buffer);
+    return size;
+}
+
 int
 add_string(uint32_t *position, size_t dest_size, size_t size, void *dest, const char *src,
            size_t sector_per_cluster) {
@@ -457,11 +702,87 @@ struct dir_t *dir_open(struct volume_t *pvolume, const char *dir_path) {
             return NULL;
         }
         result->volume = pvolume;
+        result->entries = pvolume->root;
         result->pos = 0;
 
     } else {
-        free(result);
-        return NULL;
+
+        uint16_t dir_cluster;
+        char sfn_name[11];
+        struct SFN entry;
+        uint32_t address;
+
+        int error = lookup_path(pvolume, dir_path, &dir_cluster, sfn_name, &entry, &address);
+        if (error != 0) {
+            if (error == 1) {
+                errno = ENOENT;
+            }
+            free(result);
+            return NULL;
+        }
+        if ((entry.file_attributes & 0x10) != 0x10) {
+            free(result);
+            errno = ENOTDIR;
+            return NULL;
+        }
+
+        uint16_t *fat = (uint16_t *) pvolume->fat1;
+        uint32_t cluster_count = get_cluster_count(pvolume);
+        size_t length = 0;
+        size_t capacity = 0;
+
+        //Same bounds as find_entry: a chain that loops or leaves the data area ends the directory
+        uint16_t cluster = entry.low_order_address_of_first_cluster;
+        for (size_t steps = 0; cluster >= 2 && cluster < cluster_count + 2 && steps < cluster_count; ++steps) {
+            if (length == capacity) {
+                capacity = capacity == 0 ? 4 : capacity * 2;
+                uint16_t *clusters = realloc(result->clusters, capacity * sizeof(uint16_t));
+                if (clusters == NULL) {
+                    free(result->clusters);
+                    free(result);
+                    errno = ENOMEM;
+                    return NULL;
+                }
+                result->clusters = clusters;
+            }
+            result->clusters[length++] = cluster;
+            if (fat[cluster] >= 0xFFF8) {
+                break;
+            }
+            cluster = fat[cluster];
+        }
+        if (length == 0) {
+            free(result->clusters);
+            free(result);
+            errno = EINVAL;
+            return NULL;
+        }
+
+        size_t cluster_size = pvolume->boot_sector->sectors_per_clusters * 512;
+        result->file_count = length * cluster_size / sizeof(struct SFN);
+        result->entries = calloc(result->file_count, sizeof(struct SFN));
+        result->files = calloc(result->file_count, sizeof(struct dir_entry_t));
+        if (result->entries == NULL || result->files == NULL) {
+            free(result->clusters);
+            free(result->entries);
+            free(result->files);
+            free(result);
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        for (size_t i = 0; i < length; ++i) {
+            if (read_cluster(pvolume, result->clusters[i], (char *) result->entries + i * cluster_size) != 0) {
+                free(result->clusters);
+                free(result->entries);
+                free(result->files);
+                free(result);
+                return NULL;
+            }
+        }
+
+        result->volume = pvolume;
+        result->pos = 0;
     }
 
     return result;
@@ -503,6 +824,21 @@ int generate_name(const struct SFN *file, char *dest) {
     return 1;
 }
 
+//Everything but the name, which generate_name fills in
+void make_dir_entry(struct volume_t *pvolume, const struct SFN *entry, uint32_t address, struct dir_entry_t *pentry) {
+    pentry->size = entry->size;
+    pentry->volume = pvolume;
+    pentry->is_archived = (entry->file_attributes & 0x20) >> 5;
+    pentry->is_readonly = entry->file_attributes & 0x01;
+    pentry->is_system = (entry->file_attributes & 0x04) >> 2;
+    pentry->is_directory = (entry->file_attributes & 0x10) >> 4;
+    pentry->is_hidden = (entry->file_attributes & 0x02) >> 1;
+    pentry->first_cluster = entry->low_order_address_of_first_cluster;
+    pentry->modified_time = entry->modified_time;
+    pentry->modified_date = entry->modified_date;
+    pentry->address = address;
+}
+
 int dir_read(struct dir_t *pdir, struct dir_entry_t *pentry) {
     if (pdir == NULL || pentry == NULL) {
         errno = EFAULT;
@@ -512,25 +848,28 @@ int dir_read(struct dir_t *pdir, struct dir_entry_t *pentry) {
         return 1;
     }
     size_t current_pos = pdir->pos;
-    struct SFN *temp = &pdir->volume->root[current_pos];
+    struct SFN *temp = &pdir->entries[current_pos];
 
     while (1) {
         if(pdir->pos >= pdir->file_count){
             return 1;
         }
-        if (generate_name(temp, pentry->name) == 0) {
+        if ((temp->file_attributes & 0x0F) == 0x0F || (temp->file_attributes & 0x08) == 0x08 ||
+            generate_name(temp, pentry->name) == 0) {
             ++(pdir->pos);
             ++current_pos;
-            temp = &pdir->volume->root[current_pos];
+            temp = &pdir->entries[current_pos];
             continue;
         }
-        pentry->size = temp->size;
-        pentry->volume = pdir->volume;
-        pentry->is_archived = (temp->file_attributes & 0x20) >> 5;
-        pentry->is_readonly = temp->file_attributes & 0x01;
-        pentry->is_system = (temp->file_attributes & 0x04) >> 2;
-        pentry->is_directory = (temp->file_attributes & 0x10) >> 4;
-        pentry->is_hidden = (temp->file_attributes & 0x02) >> 1;
+        uint32_t address;
+        if (pdir->clusters == NULL) {
+            address = get_root_start(pdir->volume) * 512 + current_pos * sizeof(struct SFN);
+        } else {
+            size_t entries_per_cluster = pdir->volume->boot_sector->sectors_per_clusters * 512 / sizeof(struct SFN);
+            address = get_cluster_address(pdir->volume, pdir->clusters[current_pos / entries_per_cluster]) +
+                      (current_pos % entries_per_cluster) * sizeof(struct SFN);
+        }
+        make_dir_entry(pdir->volume, temp, address, pentry);
 
         ++(pdir->pos);
         break;
@@ -546,6 +885,10 @@ int dir_close(struct dir_t *pdir) {
     }
 
     free(pdir->files);
+    free(pdir->clusters);
+    if (pdir->entries != pdir->volume->root) {
+        free(pdir->entries);
+    }
 
     free(pdir);
     return 0;
@@ -601,3 +944,1311 @@ int is_name_empty(const char *name) {
 
     return 0;
 }
+
+uint32_t get_root_start(const struct volume_t *pvolume) {
+
+    return pvolume->boot_sector->size_of_reserved_area +
+           pvolume->boot_sector->number_of_fats * pvolume->boot_sector->size_of_fat;
+}
+
+uint32_t get_data_start(const struct volume_t *pvolume) {
+
+    return get_root_start(pvolume) + pvolume->boot_sector->maximum_number_of_files * sizeof(struct SFN) / 512;
+}
+
+uint32_t get_cluster_count(const struct volume_t *pvolume) {
+
+    uint32_t total_sectors = pvolume->boot_sector->number_of_sectors;
+    if (total_sectors == 0) {
+        total_sectors = pvolume->boot_sector->number_of_sectors_in_filesystem;
+    }
+
+    uint32_t data_start = get_data_start(pvolume);
+    if (total_sectors <= data_start || pvolume->boot_sector->sectors_per_clusters == 0) {
+        return 0;
+    }
+
+    uint32_t count = (total_sectors - data_start) / pvolume->boot_sector->sectors_per_clusters;
+    uint32_t fat_entries = pvolume->boot_sector->size_of_fat * pvolume->boot_sector->bytes_per_sector / 2;
+    if (count + 2 > fat_entries) {
+        count = fat_entries - 2;
+    }
+
+    return count;
+}
+
+int read_cluster(const struct volume_t *pvolume, uint16_t cluster, void *buffer) {
+    if (pvolume == NULL || buffer == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (cluster < 2 || cluster >= get_cluster_count(pvolume) + 2) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint32_t address = get_data_start(pvolume) + (cluster - 2) * pvolume->boot_sector->sectors_per_clusters;
+
+    int error = volume_read(pvolume, address, buffer, pvolume->boot_sector->sectors_per_clusters);
+    if (error != pvolume->boot_sector->sectors_per_clusters) {
+        return -1;
+    }
+
+    return 0;
+}
+
+//Characters a short name may not contain, besides spaces and control characters
+int is_sfn_char(char c) {
+    return (unsigned char) c > ' ' && strchr("\"*+,./:;<=>?[\\]|", c) == NULL;
+}
+
+int make_sfn_name(const char *name, char *dest) {
+    if (name == NULL || dest == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(dest, ' ', 11);
+
+    int dot = find_dot_pos(name);
+    if (dot == 0 || dot > 8) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (int i = 0; i < dot; ++i) {
+        if (!is_sfn_char(name[i])) {
+            errno = EINVAL;
+            return -1;
+        }
+        dest[i] = (char) toupper((unsigned char) name[i]);
+    }
+
+    if (name[dot] == '.') {
+        const char *extension = name + dot + 1;
+        size_t length = strlen(extension);
+        if (length > 3 || strchr(extension, '.') != NULL) {
+            errno = EINVAL;
+            return -1;
+        }
+        for (size_t i = 0; i < length; ++i) {
+            if (!is_sfn_char(extension[i])) {
+                errno = EINVAL;
+                return -1;
+            }
+            dest[8 + i] = (char) toupper((unsigned char) extension[i]);
+        }
+    }
+
+    return 0;
+}
+
+uint32_t get_cluster_address(const struct volume_t *pvolume, uint16_t cluster) {
+
+    return (get_data_start(pvolume) + (cluster - 2) * pvolume->boot_sector->sectors_per_clusters) * 512;
+}
+
+int find_entry(struct volume_t *pvolume, uint16_t dir_cluster, const char *sfn_name, struct SFN *entry,
+               uint32_t *address) {
+
+    if (dir_cluster == 0) {
+        for (int i = 0; i < pvolume->boot_sector->maximum_number_of_files; ++i) {
+            if (pvolume->root[i].filename[0] == 0x00) {
+                break;
+            }
+            if (memcmp(pvolume->root[i].filename, sfn_name, 11) == 0 &&
+                (pvolume->root[i].file_attributes & 0x0F) != 0x0F) {
+                memcpy(entry, &pvolume->root[i], sizeof(struct SFN));
+                *address = get_root_start(pvolume) * 512 + i * sizeof(struct SFN);
+                return 0;
+            }
+        }
+        errno = ENOENT;
+        return -1;
+    }
+
+    uint16_t *fat = (uint16_t *) pvolume->fat1;
+    uint32_t cluster_count = get_cluster_count(pvolume);
+    size_t entries_per_cluster = pvolume->boot_sector->sectors_per_clusters * 512 / sizeof(struct SFN);
+    struct SFN *buffer = calloc(entries_per_cluster, sizeof(struct SFN));
+    if (buffer == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    uint16_t cluster = dir_cluster;
+    for (size_t steps = 0; cluster >= 2 && cluster < cluster_count + 2 && steps < cluster_count; ++steps) {
+        if (read_cluster(pvolume, cluster, buffer) != 0) {
+            free(buffer);
+            return -1;
+        }
+        for (size_t i = 0; i < entries_per_cluster; ++i) {
+            if (buffer[i].filename[0] == 0x00) {
+                free(buffer);
+                errno = ENOENT;
+                return -1;
+            }
+            if (memcmp(buffer[i].filename, sfn_name, 11) == 0 && (buffer[i].file_attributes & 0x0F) != 0x0F) {
+                memcpy(entry, &buffer[i], sizeof(struct SFN));
+                *address = get_cluster_address(pvolume, cluster) + i * sizeof(struct SFN);
+                free(buffer);
+                return 0;
+            }
+        }
+        if (fat[cluster] >= 0xFFF8) {
+            break;
+        }
+        cluster = fat[cluster];
+    }
+
+    free(buffer);
+    errno = ENOENT;
+    return -1;
+}
+
+int lookup_path(struct volume_t *pvolume, const char *path, uint16_t *dir_cluster, char *sfn_name,
+                struct SFN *entry, uint32_t *address) {
+
+    char component[13];
+    uint16_t current = 0;
+    const char *start = path;
+
+    while (1) {
+        while (*start == '\\' || *start == '/') {
+            ++start;
+        }
+        size_t length = strcspn(start, "\\/");
+        if (length == 0 || length >= sizeof(component)) {
+            errno = length == 0 ? ENOENT : EINVAL;
+            return -1;
+        }
+        memcpy(component, start, length);
+        component[length] = '\0';
+        start += length;
+        while (*start == '\\' || *start == '/') {
+            ++start;
+        }
+
+        if (make_sfn_name(component, sfn_name) != 0) {
+            return -1;
+        }
+
+        if (*start == '\0') {
+            *dir_cluster = current;
+            if (find_entry(pvolume, current, sfn_name, entry, address) != 0) {
+                return errno == ENOENT ? 1 : -1;
+            }
+            return 0;
+        }
+
+        if (find_entry(pvolume, current, sfn_name, entry, address) != 0) {
+            return -1;
+        }
+        if ((entry->file_attributes & 0x10) != 0x10) {
+            errno = ENOTDIR;
+            return -1;
+        }
+        current = entry->low_order_address_of_first_cluster;
+    }
+}
+
+int write_fat_copies(struct volume_t *pvolume) {
+
+    int32_t sectors = pvolume->fat_dirty_last - pvolume->fat_dirty_first + 1;
+    const char *source = pvolume->fat2 + pvolume->fat_dirty_first * pvolume->boot_sector->bytes_per_sector;
+
+    for (int i = 0; i < pvolume->boot_sector->number_of_fats; ++i) {
+        uint32_t address = pvolume->boot_sector->size_of_reserved_area + i * pvolume->boot_sector->size_of_fat +
+                           pvolume->fat_dirty_first;
+        if (disk_write(pvolume->disk, (int32_t) address * 512, source, sectors) != sectors) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int fat_flush_allocations(struct volume_t *pvolume) {
+    if (pvolume == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (pvolume->fat_dirty_first == -1) {
+        return 0;
+    }
+
+    uint16_t *fat = (uint16_t *) pvolume->fat1;
+    uint16_t *on_disk = (uint16_t *) pvolume->fat2;
+    uint32_t per_sector = pvolume->boot_sector->bytes_per_sector / 2;
+    uint32_t first = pvolume->fat_dirty_first * per_sector;
+    uint32_t end = (pvolume->fat_dirty_last + 1) * per_sector;
+
+    //Taking a free cluster or extending a chain past its end is safe to publish before the directory;
+    //anything that frees or cuts a chain has to wait until no entry points at it any more
+    for (uint32_t cluster = first; cluster < end; ++cluster) {
+        if (on_disk[cluster] == 0 || (on_disk[cluster] >= 0xFFF8 && fat[cluster] != 0)) {
+            on_disk[cluster] = fat[cluster];
+        }
+    }
+
+    return write_fat_copies(pvolume);
+}
+
+int fat_flush(struct volume_t *pvolume) {
+    if (pvolume == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (pvolume->fat_dirty_first == -1) {
+        return 0;
+    }
+
+    uint32_t per_sector = pvolume->boot_sector->bytes_per_sector / 2;
+    uint32_t first = pvolume->fat_dirty_first * per_sector;
+    uint32_t end = (pvolume->fat_dirty_last + 1) * per_sector;
+
+    memcpy(pvolume->fat2 + first * 2, pvolume->fat1 + first * 2, (end - first) * 2);
+    if (write_fat_copies(pvolume) != 0) {
+        return -1;
+    }
+
+    //Freed clusters become available for allocation only now that the FAT on disk agrees
+    if (pvolume->free_map != NULL) {
+        uint16_t *fat = (uint16_t *) pvolume->fat1;
+        uint32_t limit = get_cluster_count(pvolume) + 2;
+        for (uint32_t cluster = first < 2 ? 2 : first; cluster < end && cluster < limit; ++cluster) {
+            if (fat[cluster] == 0) {
+                bit_set(pvolume->free_map, cluster);
+            }
+        }
+    }
+
+    pvolume->fat_dirty_first = -1;
+    pvolume->fat_dirty_last = -1;
+
+    return 0;
+}
+
+struct dirty_sector_t *find_dirty_sector(const struct volume_t *pvolume, uint32_t sector) {
+
+    if (pvolume->dirty == NULL) {
+        return NULL;
+    }
+
+    size_t capacity = 2 * DIRTY_SECTORS_LIMIT;
+    size_t slot = (sector * 2654435761u) % capacity;
+
+    while (pvolume->dirty[slot].is_used) {
+        if (pvolume->dirty[slot].sector == sector) {
+            return &pvolume->dirty[slot];
+        }
+        slot = (slot + 1) % capacity;
+    }
+
+    return NULL;
+}
+
+int volume_read(const struct volume_t *pvolume, uint32_t first_sector, void *buffer, int32_t sectors_to_read) {
+    if (pvolume == NULL || buffer == NULL || sectors_to_read <= 0) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    int error = disk_read(pvolume->disk, (int32_t) first_sector * 512, buffer, sectors_to_read);
+    if (error != sectors_to_read || pvolume->dirty_count == 0) {
+        return error;
+    }
+
+    //Pending writes shadow what is on disk
+    for (int32_t i = 0; i < sectors_to_read; ++i) {
+        struct dirty_sector_t *dirty = find_dirty_sector(pvolume, first_sector + i);
+        if (dirty != NULL) {
+            memcpy((char *) buffer + i * 512, dirty->data, 512);
+        }
+    }
+
+    return sectors_to_read;
+}
+
+struct dirty_sector_t *insert_dirty_sector(struct volume_t *pvolume, uint32_t sector) {
+
+    size_t capacity = 2 * DIRTY_SECTORS_LIMIT;
+    size_t slot = (sector * 2654435761u) % capacity;
+    while (pvolume->dirty[slot].is_used) {
+        slot = (slot + 1) % capacity;
+    }
+
+    struct dirty_sector_t *dirty = &pvolume->dirty[slot];
+    dirty->is_used = 1;
+    dirty->sector = sector;
+    ++pvolume->dirty_count;
+    return dirty;
+}
+
+int volume_write(struct volume_t *pvolume, uint8_t kind, uint32_t first_sector, const void *buffer,
+                 int32_t sectors_to_write) {
+    if (pvolume == NULL || buffer == NULL || sectors_to_write <= 0) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (!pvolume->disk->is_writable) {
+        errno = EROFS;
+        return -1;
+    }
+
+    if (pvolume->dirty == NULL) {
+        pvolume->dirty = calloc(2 * DIRTY_SECTORS_LIMIT, sizeof(struct dirty_sector_t));
+        if (pvolume->dirty == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    for (int32_t i = 0; i < sectors_to_write; ++i) {
+        uint32_t sector = first_sector + i;
+        struct dirty_sector_t *dirty = find_dirty_sector(pvolume, sector);
+
+        if (dirty == NULL) {
+            if (pvolume->dirty_count >= DIRTY_SECTORS_LIMIT && volume_flush_data(pvolume) != 0) {
+                return -1;
+            }
+            dirty = insert_dirty_sector(pvolume, sector);
+            dirty->kind = kind;
+        } else if (dirty->kind != SECTOR_DATA) {
+            //A sector already pending as data may be a new directory cluster that is not linked in yet; it
+            //stays in the data phase, ahead of the FAT entries that link it, once entries are written into it
+            dirty->kind = kind;
+        }
+
+        memcpy(dirty->data, (const char *) buffer + i * 512, 512);
+    }
+
+    return sectors_to_write;
+}
+
+int volume_write_through(struct volume_t *pvolume, uint32_t first_sector, const void *buffer,
+                         int32_t sectors_to_write) {
+    if (pvolume == NULL || buffer == NULL || sectors_to_write <= 0) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (!pvolume->disk->is_writable) {
+        errno = EROFS;
+        return -1;
+    }
+
+    if (disk_write(pvolume->disk, (int32_t) first_sector * 512, buffer, sectors_to_write) != sectors_to_write) {
+        return -1;
+    }
+
+    //A copy still pending for one of these sectors would overwrite them with older data at the next flush
+    if (pvolume->dirty_count > 0) {
+        for (int32_t i = 0; i < sectors_to_write; ++i) {
+            struct dirty_sector_t *dirty = find_dirty_sector(pvolume, first_sector + i);
+            if (dirty != NULL) {
+                memcpy(dirty->data, (const char *) buffer + i * 512, 512);
+            }
+        }
+    }
+
+    return sectors_to_write;
+}
+
+int compare_dirty_sectors(const void *a, const void *b) {
+    const struct dirty_sector_t *left = *(const struct dirty_sector_t *const *) a;
+    const struct dirty_sector_t *right = *(const struct dirty_sector_t *const *) b;
+
+    if (left->kind != right->kind) {
+        return left->kind < right->kind ? -1 : 1;
+    }
+    if (left->sector != right->sector) {
+        return left->sector < right->sector ? -1 : 1;
+    }
+    return 0;
+}
+
+size_t write_dirty_run(struct disk_t *pdisk, struct dirty_sector_t **sorted, size_t count, char *run) {
+
+    size_t length = 1;
+    memcpy(run, sorted[0]->data, 512);
+    while (length < count && sorted[length]->kind == sorted[0]->kind &&
+           sorted[length]->sector == sorted[0]->sector + length) {
+        memcpy(run + length * 512, sorted[length]->data, 512);
+        ++length;
+    }
+
+    if (disk_write(pdisk, (int32_t) sorted[0]->sector * 512, run, (int32_t) length) != (int32_t) length) {
+        return 0;
+    }
+    return length;
+}
+
+int volume_flush_data(struct volume_t *pvolume) {
+    if (pvolume == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    size_t data_count = 0;
+    for (size_t slot = 0; slot < 2 * DIRTY_SECTORS_LIMIT; ++slot) {
+        if (pvolume->dirty[slot].is_used && pvolume->dirty[slot].kind == SECTOR_DATA) {
+            ++data_count;
+        }
+    }
+    if (data_count == 0) {
+        //Nothing but directory entries pending, which only the full sync may write
+        return volume_sync(pvolume);
+    }
+
+    size_t kept_count = pvolume->dirty_count - data_count;
+    struct dirty_sector_t **sorted = calloc(data_count, sizeof(struct dirty_sector_t *));
+    struct dirty_sector_t *kept = calloc(kept_count > 0 ? kept_count : 1, sizeof(struct dirty_sector_t));
+    char *run = calloc(data_count, 512);
+    if (sorted == NULL || kept == NULL || run == NULL) {
+        free(sorted);
+        free(kept);
+        free(run);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t count = 0;
+    size_t kept_index = 0;
+    for (size_t slot = 0; slot < 2 * DIRTY_SECTORS_LIMIT; ++slot) {
+        if (!pvolume->dirty[slot].is_used) {
+            continue;
+        }
+        if (pvolume->dirty[slot].kind == SECTOR_DATA) {
+            sorted[count++] = &pvolume->dirty[slot];
+        } else {
+            memcpy(&kept[kept_index++], &pvolume->dirty[slot], sizeof(struct dirty_sector_t));
+        }
+    }
+    qsort(sorted, count, sizeof(struct dirty_sector_t *), compare_dirty_sectors);
+
+    //Data may reach the disk at any time, as long as it does so before the FAT entries that link it in;
+    //volume_sync fsyncs ahead of every FAT write, so no barrier is needed here
+    int error = 0;
+    for (size_t i = 0; i < count && error == 0;) {
+        size_t length = write_dirty_run(pvolume->disk, sorted + i, count - i, run);
+        if (length == 0) {
+            error = -1;
+        }
+        i += length;
+    }
+
+    if (error == 0) {
+        memset(pvolume->dirty, 0, 2 * DIRTY_SECTORS_LIMIT * sizeof(struct dirty_sector_t));
+        pvolume->dirty_count = 0;
+        for (size_t i = 0; i < kept_count; ++i) {
+            struct dirty_sector_t *dirty = insert_dirty_sector(pvolume, kept[i].sector);
+            dirty->kind = kept[i].kind;
+            memcpy(dirty->data, kept[i].data, 512);
+        }
+    }
+
+    free(sorted);
+    free(kept);
+    free(run);
+    return error;
+}
+
+int volume_sync(struct volume_t *pvolume) {
+    if (pvolume == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (pvolume->dirty_count == 0) {
+        //Data may still be on its way from volume_write_through or volume_flush_data
+        if (disk_sync(pvolume->disk) != 0 || fat_flush(pvolume) != 0) {
+            return -1;
+        }
+        return disk_sync(pvolume->disk);
+    }
+
+    struct dirty_sector_t **sorted = calloc(pvolume->dirty_count, sizeof(struct dirty_sector_t *));
+    char *run = calloc(pvolume->dirty_count, 512);
+    if (sorted == NULL || run == NULL) {
+        free(sorted);
+        free(run);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t count = 0;
+    for (size_t slot = 0; slot < 2 * DIRTY_SECTORS_LIMIT; ++slot) {
+        if (pvolume->dirty[slot].is_used) {
+            sorted[count++] = &pvolume->dirty[slot];
+        }
+    }
+    qsort(sorted, count, sizeof(struct dirty_sector_t *), compare_dirty_sectors);
+
+    //Data (including new directory clusters, see volume_write), then the FAT entries that take clusters,
+    //then directory entries, then the FAT entries that free them, with an fsync after each phase: a crash
+    //between phases leaves at worst allocated clusters nothing points to, never an entry pointing at
+    //unwritten data or at clusters the FAT already calls free. fat_open copes with FAT copies that differ
+    int error = 0;
+    int allocations_flushed = 0;
+    for (size_t i = 0; i < count && error == 0;) {
+        if (sorted[i]->kind == SECTOR_DIRECTORY && !allocations_flushed) {
+            if (disk_sync(pvolume->disk) != 0 || fat_flush_allocations(pvolume) != 0 ||
+                disk_sync(pvolume->disk) != 0) {
+                error = -1;
+                break;
+            }
+            allocations_flushed = 1;
+        }
+
+        size_t length = write_dirty_run(pvolume->disk, sorted + i, count - i, run);
+        if (length == 0) {
+            error = -1;
+        }
+        i += length;
+    }
+
+    free(sorted);
+    free(run);
+    if (error != 0) {
+        return -1;
+    }
+
+    memset(pvolume->dirty, 0, 2 * DIRTY_SECTORS_LIMIT * sizeof(struct dirty_sector_t));
+    pvolume->dirty_count = 0;
+
+    if (disk_sync(pvolume->disk) != 0 || fat_flush(pvolume) != 0) {
+        return -1;
+    }
+
+    return disk_sync(pvolume->disk);
+}
+
+struct file_t *make_stream(struct volume_t *pvolume, const struct SFN *entry, uint32_t address) {
+
+    struct file_t *result = calloc(1, sizeof(struct file_t));
+    if (result == NULL) {
+        return NULL;
+    }
+
+    memcpy(&result->file, entry, sizeof(struct SFN));
+    result->pos = 0;
+    result->bytes_per_sector = pvolume->boot_sector->bytes_per_sector;
+    result->sectors_per_clusters = pvolume->boot_sector->sectors_per_clusters;
+    result->volume = pvolume;
+    result->entry_address = address;
+
+    return result;
+}
+
+struct file_t *file_open_path(struct volume_t *pvolume, const char *path) {
+    if (pvolume == NULL || path == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+
+    uint16_t dir_cluster;
+    char sfn_name[11];
+    struct SFN entry;
+    uint32_t address;
+
+    int error = lookup_path(pvolume, path, &dir_cluster, sfn_name, &entry, &address);
+    if (error != 0) {
+        if (error == 1) {
+            errno = ENOENT;
+        }
+        return NULL;
+    }
+    if ((entry.file_attributes & 0x10) == 0x10) {
+        errno = EISDIR;
+        return NULL;
+    }
+
+    return make_stream(pvolume, &entry, address);
+}
+
+int scan_directory_block(struct recovery_t *prec, const struct SFN *entries, size_t count, uint16_t parent_cluster,
+                         uint16_t *queue, size_t *queue_size, uint8_t *visited) {
+
+    uint32_t cluster_count = get_cluster_count(prec->volume);
+
+    for (size_t i = 0; i < count; ++i) {
+        const struct SFN *entry = &entries[i];
+        unsigned char first = (unsigned char) entry->filename[0];
+
+        if (first == 0x00) {
+            return 1;
+        }
+        //LFN fragments and volume labels carry no data
+        if ((entry->file_attributes & 0x0F) == 0x0F || (entry->file_attributes & 0x08) == 0x08) {
+            continue;
+        }
+
+        if (first != 0xe5) {
+            uint16_t cluster = entry->low_order_address_of_first_cluster;
+            if ((entry->file_attributes & 0x10) == 0x10 && first != '.' && cluster >= 2 &&
+                cluster < cluster_count + 2 && !bit_test(visited, cluster)) {
+                bit_set(visited, cluster);
+                queue[(*queue_size)++] = cluster;
+            }
+            continue;
+        }
+
+        if (prec->entry_count == prec->entry_capacity) {
+            size_t capacity = prec->entry_capacity == 0 ? 16 : prec->entry_capacity * 2;
+            struct deleted_entry_t *temp = realloc(prec->entries, capacity * sizeof(struct deleted_entry_t));
+            if (temp == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            prec->entries = temp;
+            prec->entry_capacity = capacity;
+        }
+
+        struct deleted_entry_t *result = &prec->entries[prec->entry_count];
+        memset(result, 0, sizeof(struct deleted_entry_t));
+        memcpy(&result->file, entry, sizeof(struct SFN));
+        result->parent_cluster = parent_cluster;
+        result->is_directory = (entry->file_attributes & 0x10) >> 4;
+
+        struct SFN named;
+        memcpy(&named, entry, sizeof(struct SFN));
+        named.filename[0] = '_';
+        generate_name(&named, result->name);
+
+        ++prec->entry_count;
+    }
+
+    return 0;
+}
+
+int compare_first_cluster(const void *a, const void *b) {
+    const struct deleted_entry_t *left = *(const struct deleted_entry_t *const *) a;
+    const struct deleted_entry_t *right = *(const struct deleted_entry_t *const *) b;
+
+    if (left->file.low_order_address_of_first_cluster < right->file.low_order_address_of_first_cluster) {
+        return -1;
+    }
+    if (left->file.low_order_address_of_first_cluster > right->file.low_order_address_of_first_cluster) {
+        return 1;
+    }
+    return 0;
+}
+
+int reconstruct_chains(struct recovery_t *prec) {
+
+    if (prec->entry_count == 0) {
+        return 0;
+    }
+
+    struct deleted_entry_t **sorted = calloc(prec->entry_count, sizeof(struct deleted_entry_t *));
+    if (sorted == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t i = 0; i < prec->entry_count; ++i) {
+        sorted[i] = &prec->entries[i];
+    }
+    qsort(sorted, prec->entry_count, sizeof(struct deleted_entry_t *), compare_first_cluster);
+
+    uint16_t *fat = (uint16_t *) prec->volume->fat1;
+    uint32_t end = get_cluster_count(prec->volume) + 2;
+    uint32_t cluster_size = prec->volume->boot_sector->bytes_per_sector *
+                            prec->volume->boot_sector->sectors_per_clusters;
+
+    //Entries are visited by first cluster. A deleted file can only own the free clusters that
+    //directly follow its first one, up to where the next deleted file starts; anything that is
+    //cut short by an allocated cluster was fragmented and is not filled from elsewhere
+    uint32_t cursor = 2;
+    for (size_t i = 0; i < prec->entry_count; ++i) {
+        struct deleted_entry_t *entry = sorted[i];
+        uint32_t first = entry->file.low_order_address_of_first_cluster;
+        size_t needed = entry->is_directory ? 1 : (entry->file.size + cluster_size - 1) / cluster_size;
+
+        if (needed == 0) {
+            entry->is_recoverable = 1;
+            continue;
+        }
+        if (first < cursor || first >= end || fat[first] != 0) {
+            continue;
+        }
+
+        uint32_t limit = end;
+        for (size_t j = i + 1; j < prec->entry_count; ++j) {
+            uint32_t next = sorted[j]->file.low_order_address_of_first_cluster;
+            if (next > first) {
+                limit = next < end ? next : end;
+                break;
+            }
+        }
+
+        entry->chain.clusters = calloc(needed, sizeof(uint16_t));
+        if (entry->chain.clusters == NULL) {
+            free(sorted);
+            errno = ENOMEM;
+            return -1;
+        }
+
+        for (uint32_t cluster = first; cluster < limit && entry->chain.size < needed && fat[cluster] == 0;
+             ++cluster) {
+            entry->chain.clusters[entry->chain.size++] = (uint16_t) cluster;
+        }
+
+        entry->is_recoverable = entry->chain.size == needed;
+        if (entry->is_recoverable) {
+            cursor = first + (uint32_t) needed;
+        }
+    }
+
+    free(sorted);
+    return 0;
+}
+
+struct recovery_t *recovery_open(struct volume_t *pvolume) {
+    if (pvolume == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+
+    struct recovery_t *result = calloc(1, sizeof(struct recovery_t));
+    if (result == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    result->volume = pvolume;
+
+    uint32_t cluster_count = get_cluster_count(pvolume);
+    uint16_t *queue = calloc(cluster_count + 1, sizeof(uint16_t));
+    uint8_t *visited = calloc((cluster_count + 2) / 8 + 1, sizeof(uint8_t));
+    char *buffer = calloc(pvolume->boot_sector->sectors_per_clusters * 512, sizeof(char));
+    if (queue == NULL || visited == NULL || buffer == NULL) {
+        free(queue);
+        free(visited);
+        free(buffer);
+        free(result);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t queue_size = 0;
+    int error = scan_directory_block(result, pvolume->root, pvolume->boot_sector->maximum_number_of_files, 0,
+                                     queue, &queue_size, visited);
+
+    //Breadth-first over live subdirectories; each directory cluster is read exactly once
+    uint16_t *fat = (uint16_t *) pvolume->fat1;
+    size_t entries_per_cluster = pvolume->boot_sector->sectors_per_clusters * 512 / sizeof(struct SFN);
+    for (size_t i = 0; i < queue_size && error != -1; ++i) {
+        uint16_t cluster = queue[i];
+        size_t steps = 0;
+
+        while (cluster >= 2 && cluster < cluster_count + 2 && steps++ < cluster_count) {
+            if (read_cluster(pvolume, cluster, buffer) != 0) {
+                break;
+            }
+            error = scan_directory_block(result, (struct SFN *) buffer, entries_per_cluster, queue[i],
+                                         queue, &queue_size, visited);
+            if (error != 0 || fat[cluster] >= 0xFFF8) {
+                break;
+            }
+            cluster = fat[cluster];
+        }
+    }
+
+    free(queue);
+    free(visited);
+    free(buffer);
+
+    if (error == -1 || reconstruct_chains(result) != 0) {
+        recovery_close(result);
+        return NULL;
+    }
+
+    return result;
+}
+
+int recovery_read(struct recovery_t *prec, struct deleted_entry_t *pentry) {
+    if (prec == NULL || pentry == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (prec->pos >= prec->entry_count) {
+        return 1;
+    }
+
+    memcpy(pentry, &prec->entries[prec->pos], sizeof(struct deleted_entry_t));
+    ++(prec->pos);
+
+    return 0;
+}
+
+struct file_t *recovery_file_open(struct volume_t *pvolume, const struct deleted_entry_t *pentry) {
+    if (pvolume == NULL || pentry == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    if (pentry->is_directory) {
+        errno = EISDIR;
+        return NULL;
+    }
+    if (!pentry->is_recoverable) {
+        errno = ENODATA;
+        return NULL;
+    }
+
+    struct file_t *result = calloc(1, sizeof(struct file_t));
+    if (result == NULL) {
+        return NULL;
+    }
+    result->chain = calloc(1, sizeof(struct clusters_chain_t));
+    if (result->chain == NULL) {
+        free(result);
+        return NULL;
+    }
+    if (pentry->chain.size > 0) {
+        result->chain->clusters = calloc(pentry->chain.size, sizeof(uint16_t));
+        if (result->chain->clusters == NULL) {
+            free(result->chain);
+            free(result);
+            return NULL;
+        }
+        memcpy(result->chain->clusters, pentry->chain.clusters, pentry->chain.size * sizeof(uint16_t));
+    }
+    result->chain->size = pentry->chain.size;
+
+    memcpy(&result->file, &pentry->file, sizeof(struct SFN));
+    result->pos = 0;
+    result->bytes_per_sector = pvolume->boot_sector->bytes_per_sector;
+    result->sectors_per_clusters = pvolume->boot_sector->sectors_per_clusters;
+    result->volume = pvolume;
+
+    return result;
+}
+
+int recovery_close(struct recovery_t *prec) {
+    if (prec == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    for (size_t i = 0; i < prec->entry_count; ++i) {
+        free(prec->entries[i].chain.clusters);
+    }
+    free(prec->entries);
+    free(prec);
+
+    return 0;
+}
+
+int bit_test(const uint8_t *bits, uint32_t index) {
+    return (bits[index / 8] >> (index % 8)) & 1;
+}
+
+void bit_set(uint8_t *bits, uint32_t index) {
+    bits[index / 8] |= (uint8_t) (1 << (index % 8));
+}
+
+int check_chain(struct volume_t *pvolume, const struct SFN *entry, uint8_t *owned, uint8_t *crossed,
+                struct check_report_t *report) {
+
+    uint16_t *fat = (uint16_t *) pvolume->fat1;
+    uint32_t end = get_cluster_count(pvolume) + 2;
+    uint32_t cluster_size = pvolume->boot_sector->bytes_per_sector * pvolume->boot_sector->sectors_per_clusters;
+    int is_directory = (entry->file_attributes & 0x10) == 0x10;
+    uint32_t cluster = entry->low_order_address_of_first_cluster;
+
+    ++report->files_checked;
+
+    if (cluster == 0) {
+        if (!is_directory && entry->size > 0) {
+            ++report->short_chains;
+        }
+        return 0;
+    }
+
+    size_t length = 0;
+    int complete = 0;
+    int first_owned = 0;
+
+    while (1) {
+        if (cluster < 2 || cluster >= end || fat[cluster] == 0 || fat[cluster] == 0xFFF7) {
+            ++report->invalid_references;
+            break;
+        }
+        if (bit_test(owned, cluster)) {
+            if (!bit_test(crossed, cluster)) {
+                bit_set(crossed, cluster);
+                ++report->cross_linked_clusters;
+            }
+            if (length == 0) {
+                first_owned = 1;
+            }
+            break;
+        }
+        bit_set(owned, cluster);
+        ++length;
+
+        if (fat[cluster] >= 0xFFF8) {
+            complete = 1;
+            break;
+        }
+        cluster = fat[cluster];
+    }
+
+    if (!is_directory && complete) {
+        size_t expected = (entry->size + cluster_size - 1) / cluster_size;
+        if (length < expected) {
+            ++report->short_chains;
+        } else if (length > expected) {
+            ++report->long_chains;
+        }
+    }
+
+    //Only directories whose chain we own are descended into, so a cross-linked tree is walked once;
+    //the owned length tells the caller where this directory's own clusters end
+    return is_directory && !first_owned ? (int) length : 0;
+}
+
+int check_directory_block(struct volume_t *pvolume, const struct SFN *entries, size_t count, uint16_t *queue,
+                          uint16_t *queue_length, size_t *queue_size, uint8_t *owned, uint8_t *crossed,
+                          struct check_report_t *report) {
+
+    for (size_t i = 0; i < count; ++i) {
+        const struct SFN *entry = &entries[i];
+        unsigned char first = (unsigned char) entry->filename[0];
+
+        if (first == 0x00) {
+            return 1;
+        }
+        if (first == 0xe5 || first == '.') {
+            continue;
+        }
+        if ((entry->file_attributes & 0x0F) == 0x0F || (entry->file_attributes & 0x08) == 0x08) {
+            continue;
+        }
+
+        int length = check_chain(pvolume, entry, owned, crossed, report);
+        if (length > 0) {
+            queue[*queue_size] = entry->low_order_address_of_first_cluster;
+            queue_length[*queue_size] = (uint16_t) length;
+            ++(*queue_size);
+        }
+    }
+
+    return 0;
+}
+
+int fat_check(struct volume_t *pvolume, struct check_report_t *report) {
+    if (pvolume == NULL || report == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    memset(report, 0, sizeof(struct check_report_t));
+
+    uint32_t cluster_count = get_cluster_count(pvolume);
+    uint32_t end = cluster_count + 2;
+    size_t bitset_size = end / 8 + 1;
+    uint8_t *owned = calloc(bitset_size, sizeof(uint8_t));
+    uint8_t *crossed = calloc(bitset_size, sizeof(uint8_t));
+    uint8_t *referenced = calloc(bitset_size, sizeof(uint8_t));
+    uint16_t *queue = calloc(cluster_count + 1, sizeof(uint16_t));
+    uint16_t *queue_length = calloc(cluster_count + 1, sizeof(uint16_t));
+    char *buffer = calloc(pvolume->boot_sector->sectors_per_clusters * 512, sizeof(char));
+    if (owned == NULL || crossed == NULL || referenced == NULL || queue == NULL || queue_length == NULL ||
+        buffer == NULL) {
+        free(owned);
+        free(crossed);
+        free(referenced);
+        free(queue);
+        free(queue_length);
+        free(buffer);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t queue_size = 0;
+    check_directory_block(pvolume, pvolume->root, pvolume->boot_sector->maximum_number_of_files, queue,
+                          queue_length, &queue_size, owned, crossed, report);
+
+    //Only the prefix check_chain claimed for the directory is read back; a chain cross-linked into
+    //another file's clusters is never parsed as directory entries
+    uint16_t *fat = (uint16_t *) pvolume->fat1;
+    size_t entries_per_cluster = pvolume->boot_sector->sectors_per_clusters * 512 / sizeof(struct SFN);
+    int error = 0;
+    for (size_t i = 0; i < queue_size; ++i) {
+        uint16_t cluster = queue[i];
+        size_t steps = 0;
+
+        while (cluster >= 2 && cluster < end && steps++ < queue_length[i]) {
+            if (read_cluster(pvolume, cluster, buffer) != 0) {
+                error = -1;
+                break;
+            }
+            if (check_directory_block(pvolume, (struct SFN *) buffer, entries_per_cluster, queue, queue_length,
+                                      &queue_size, owned, crossed, report) != 0 || fat[cluster] >= 0xFFF8) {
+                break;
+            }
+            cluster = fat[cluster];
+        }
+    }
+
+    for (uint32_t cluster = 2; cluster < end; ++cluster) {
+        if (fat[cluster] >= 2 && fat[cluster] < end) {
+            bit_set(referenced, fat[cluster]);
+        }
+    }
+    for (uint32_t cluster = 2; cluster < end; ++cluster) {
+        if (fat[cluster] == 0 || fat[cluster] == 0xFFF7 || bit_test(owned, cluster)) {
+            continue;
+        }
+        ++report->lost_clusters;
+        if (!bit_test(referenced, cluster)) {
+            ++report->lost_chains;
+        }
+        if (fat[cluster] < 0xFFF8 && (fat[cluster] < 2 || fat[cluster] >= end)) {
+            ++report->invalid_references;
+        }
+    }
+
+    free(owned);
+    free(crossed);
+    free(referenced);
+    free(queue);
+    free(queue_length);
+    free(buffer);
+
+    return error;
+}
+
+//Chunked compressed image backend used by disk_t.
+//Layout: compressed_header_t, chunk data, then chunk_count chunk_index_t records at
+//header.index_offset. Every chunk decodes to header.chunk_size bytes (the last one may be
+//shorter); CHUNK_ZERO chunks have no stored bytes at all.
+
+//PackBits-style: a control byte below 128 is followed by that many + 1 literal bytes,
+//128 and above repeats the next byte (control - 128 + 3) times
+size_t rle_encode(const uint8_t *src, size_t size, uint8_t *dest, size_t dest_size) {
+
+    size_t in = 0;
+    size_t out = 0;
+
+    while (in < size) {
+        size_t run = 1;
+        while (in + run < size && run < 130 && src[in + run] == src[in]) {
+            ++run;
+        }
+
+        if (run >= 3) {
+            if (out + 2 > dest_size) {
+                return 0;
+            }
+            dest[out++] = (uint8_t) (128 + run - 3);
+            dest[out++] = src[in];
+            in += run;
+            continue;
+        }
+
+        size_t literal = 0;
+        while (in + literal < size && literal < 128) {
+            if (in + literal + 2 < size && src[in + literal] == src[in + literal + 1] &&
+                src[in + literal] == src[in + literal + 2]) {
+                break;
+            }
+            ++literal;
+        }
+        if (out + 1 + literal > dest_size) {
+            return 0;
+        }
+        dest[out++] = (uint8_t) (literal - 1);
+        memcpy(dest + out, src + in, literal);
+        out += literal;
+        in += literal;
+    }
+
+    return out;
+}
+
+int rle_decode(const uint8_t *src, size_t size, uint8_t *dest, size_t dest_size) {
+
+    size_t in = 0;
+    size_t out = 0;
+
+    while (in < size) {
+        uint8_t control = src[in++];
+
+        if (control < 128) {
+            size_t literal = (size_t) control + 1;
+            if (in + literal > size || out + literal > dest_size) {
+                return -1;
+            }
+            memcpy(dest + out, src + in, literal);
+            in += literal;
+            out += literal;
+        } else {
+            size_t run = (size_t) control - 128 + 3;
+            if (in >= size || out + run > dest_size) {
+                return -1;
+            }
+            memset(dest + out, src[in++], run);
+            out += run;
+        }
+    }
+
+    return out == dest_size ? 0 : -1;
+}
+
+int compressed_open(struct disk_t *pdisk) {
+
+    struct compressed_t *result = calloc(1, sizeof(struct compressed_t));
+    if (result == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    rewind(pdisk->f);
+    if (fread(&result->header, sizeof(struct compressed_header_t), 1, pdisk->f) != 1 ||
+        result->header.chunk_size == 0 || result->header.chunk_size % 512 != 0 ||
+        (result->header.image_size + result->header.chunk_size - 1) / result->header.chunk_size !=
+        result->header.chunk_count) {
+        free(result);
+        errno = EINVAL;
+        return -1;
+    }
+
+    result->index = calloc(result->header.chunk_count, sizeof(struct chunk_index_t));
+    result->scratch = malloc(result->header.chunk_size);
+    if ((result->index == NULL && result->header.chunk_count > 0) || result->scratch == NULL) {
+        free(result->index);
+        free(result->scratch);
+        free(result);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (fseek(pdisk->f, (long) result->header.index_offset, SEEK_SET) != 0 ||
+        fread(result->index, sizeof(struct chunk_index_t), result->header.chunk_count, pdisk->f) !=
+        result->header.chunk_count) {
+        free(result->index);
+        free(result->scratch);
+        free(result);
+        errno = EINVAL;
+        return -1;
+    }
+
+    pdisk->compressed = result;
+    pdisk->is_writable = 0;
+
+    return 0;
+}
+
+uint8_t *get_chunk(struct disk_t *pdisk, uint32_t chunk) {
+
+    struct compressed_t *compressed = pdisk->compressed;
+    struct chunk_cache_t *slot = NULL;
+
+    ++compressed->clock;
+    for (int i = 0; i < CHUNK_CACHE_SLOTS; ++i) {
+        struct chunk_cache_t *candidate = &compressed->cache[i];
+        if (candidate->is_valid && candidate->chunk == chunk) {
+            candidate->last_used = compressed->clock;
+            return candidate->data;
+        }
+        if (slot == NULL || !candidate->is_valid ||
+            (slot->is_valid && candidate->last_used < slot->last_used)) {
+            slot = candidate;
+        }
+    }
+
+    if (slot->data == NULL) {
+        slot->data = malloc(compressed->header.chunk_size);
+        if (slot->data == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    slot->is_valid = 0;
+
+    const struct chunk_index_t *entry = &compressed->index[chunk];
+    uint64_t start = (uint64_t) chunk * compressed->header.chunk_size;
+    size_t length = compressed->header.image_size - start < compressed->header.chunk_size ?
+                    (size_t) (compressed->header.image_size - start) : compressed->header.chunk_size;
+
+    if (entry->stored_size > compressed->header.chunk_size ||
+        fseek(pdisk->f, (long) entry->offset, SEEK_SET) != 0 ||
+        fread(compressed->scratch, 1, entry->stored_size, pdisk->f) != entry->stored_size) {
+        errno = EIO;
+        return NULL;
+    }
+
+    if (entry->codec == CHUNK_RAW && entry->stored_size == length) {
+        memcpy(slot->data, compressed->scratch, length);
+    } else if (entry->codec != CHUNK_RLE ||
+               rle_decode(compressed->scratch, entry->stored_size, slot->data, length) != 0) {
+        errno = EIO;
+        return NULL;
+    }
+
+    slot->chunk = chunk;
+    slot->last_used = compressed->clock;
+    slot->is_valid = 1;
+
+    return slot->data;
+}
+
+int compressed_read(struct disk_t *pdisk, int32_t first_sector, void *buffer, int32_t sectors_to_read) {
+
+    struct compressed_t *compressed = pdisk->compressed;
+
+    if (first_sector != -1) {
+        compressed->position = (uint32_t) first_sector;
+    }
+
+    uint64_t size = (uint64_t) sectors_to_read * 512;
+    if (compressed->position + size > compressed->header.image_size) {
+        errno = ERANGE;
+        return -1;
+    }
+
+    uint8_t *dest = (uint8_t *) buffer;
+    while (size > 0) {
+        uint32_t chunk = (uint32_t) (compressed->position / compressed->header.chunk_size);
+        uint32_t inner = (uint32_t) (compressed->position % compressed->header.chunk_size);
+        uint64_t count = compressed->header.chunk_size - inner;
+        if (count > size) {
+            count = size;
+        }
+
+        //Zero chunks are answered without touching the file or the cache
+        if (compressed->index[chunk].codec == CHUNK_ZERO) {
+            memset(dest, 0, count);
+        } else {
+            uint8_t *data = get_chunk(pdisk, chunk);
+            if (data == NULL) {
+                return -1;
+            }
+            memcpy(dest, data + inner, count);
+        }
+
+        dest += count;
+        compressed->position += count;
+        size -= count;
+    }
+
+    return sectors_to_read;
+}
+
+void compressed_close(struct disk_t *pdisk) {
+
+    struct compressed_t *compressed = pdisk->compressed;
+
+    for (int i = 0; i < CHUNK_CACHE_SLOTS; ++i) {
+        free(compressed->cache[i].data);
+    }
+    free(compressed->index);
+    free(compressed->scratch);
+    free(compressed);
+
+    pdisk->compressed = NULL;
+}
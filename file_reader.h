@@ -63,16 +63,73 @@ struct __attribute__((__packed__)) SFN {
 
 //dante
 
+#define COMPRESSED_MAGIC "F16Z\0\0\0\1"
+#define COMPRESSED_CHUNK_SIZE (64 * 1024) //Default for new images; readers take it from the header
+#define CHUNK_CACHE_SLOTS 16
+
+#define CHUNK_ZERO 0 //All-zero chunk, nothing stored
+#define CHUNK_RAW 1
+#define CHUNK_RLE 2
+
+struct __attribute__((__packed__)) compressed_header_t {
+    char magic[8];
+    uint32_t chunk_size;
+    uint32_t chunk_count;
+    uint64_t image_size; //Size of the raw image in bytes
+    uint64_t index_offset; //The chunk index is written after the chunk data
+};
+
+struct __attribute__((__packed__)) chunk_index_t {
+    uint64_t offset;
+    uint32_t stored_size;
+    uint8_t codec;
+    uint8_t unused[3];
+};
+
+struct chunk_cache_t {
+    uint32_t chunk;
+    uint32_t last_used;
+    uint8_t *data;
+    unsigned int is_valid: 1;
+};
+
+struct compressed_t {
+    struct compressed_header_t header;
+    struct chunk_index_t *index;
+    struct chunk_cache_t cache[CHUNK_CACHE_SLOTS]; //Decompressed chunks, least recently used is evicted
+    uint8_t *scratch; //Stored bytes of the chunk being decoded
+    uint64_t position; //Where a disk_read with first_sector == -1 continues
+    uint32_t clock;
+};
+
 struct disk_t {
     FILE *f;
+    unsigned int is_writable: 1;
+    struct compressed_t *compressed; //NULL for raw images
+};
+
+#define SECTOR_DATA 0
+#define SECTOR_DIRECTORY 1
+#define DIRTY_SECTORS_LIMIT 2048 //Pending sectors before the write-back buffer flushes itself
+
+struct dirty_sector_t {
+    uint32_t sector;
+    uint8_t kind; //SECTOR_DATA or SECTOR_DIRECTORY, decides the flush phase
+    uint8_t is_used;
+    char data[512];
 };
 
 struct volume_t {
     struct FAT16 *boot_sector;
     char *fat1;
-    char *fat2;
+    char *fat2; //The FAT as it is on disk; differs from fat1 only in sectors not yet flushed
     struct SFN *root;
     struct disk_t *disk;
+    uint8_t *free_map; //One bit per cluster, set when free in both fat1 and fat2; built on the first allocation
+    int32_t fat_dirty_first; //First FAT sector changed since the last fat_flush, -1 when clean
+    int32_t fat_dirty_last;
+    struct dirty_sector_t *dirty; //Open-addressed by sector number, 2 * DIRTY_SECTORS_LIMIT slots
+    size_t dirty_count;
 };
 
 struct file_t {
@@ -81,11 +138,17 @@ struct file_t {
     uint16_t bytes_per_sector;
     uint8_t sectors_per_clusters;
     struct volume_t *volume;
+    struct clusters_chain_t *chain; //Explicit cluster list for recovered files; NULL means follow fat1
+    uint32_t entry_address; //Byte offset of the SFN on disk, 0 when the stream cannot be written
+    uint16_t last_cluster; //Cluster number last_index of the chain, so appends need not rewalk it; 0 when unknown
+    uint32_t last_index;
 };
 
 struct dir_t {
     struct volume_t *volume;
     struct dir_entry_t *files;
+    struct SFN *entries; //volume->root for the root directory, a loaded copy of the cluster chain otherwise
+    uint16_t *clusters; //Cluster each block of entries was loaded from, NULL for the root directory
     size_t file_count;
     size_t pos;
 };
@@ -98,6 +161,10 @@ struct dir_entry_t {
     unsigned int is_system: 1;
     unsigned int is_hidden: 1;
     unsigned int is_directory: 1;
+    uint16_t first_cluster;
+    struct my_time_t modified_time;
+    struct date_t modified_date;
+    uint32_t address; //Byte offset of the entry on disk
     struct volume_t *volume;
 };
 
@@ -106,30 +173,102 @@ struct clusters_chain_t {
     size_t size;
 };
 
+struct deleted_entry_t {
+    char name[13]; //Name with the 0xE5 marker replaced by '_'
+    struct SFN file; //Raw directory entry as found on disk
+    uint16_t parent_cluster; //First cluster of the containing directory, 0 for root
+    struct clusters_chain_t chain; //Contiguous free clusters from the first one (owned by recovery_t)
+    unsigned int is_directory: 1;
+    unsigned int is_recoverable: 1; //The chain covers SFN.size without running into allocated clusters
+};
+
+struct check_report_t {
+    size_t files_checked; //Files and directories reached from the root
+    size_t cross_linked_clusters; //Clusters claimed by more than one chain (or twice by the same one)
+    size_t lost_clusters; //Allocated clusters no directory entry leads to
+    size_t lost_chains; //Heads of the lost cluster chains
+    size_t short_chains; //Files with fewer clusters than SFN.size needs
+    size_t long_chains; //Files with more clusters than SFN.size needs
+    size_t invalid_references; //Entries or FAT links pointing outside the data area, at free or bad clusters
+};
+
+struct recovery_t {
+    struct volume_t *volume;
+    struct deleted_entry_t *entries;
+    size_t entry_count;
+    size_t entry_capacity;
+    size_t pos;
+};
+
 struct disk_t *disk_open_from_file(const char *volume_file_name);
 
+struct disk_t *disk_open_from_file_rw(const char *volume_file_name);
+
 int disk_read(struct disk_t *pdisk, int32_t first_sector, void *buffer, int32_t sectors_to_read);
 
+int disk_write(struct disk_t *pdisk, int32_t first_sector, const void *buffer, int32_t sectors_to_write);
+
 int disk_close(struct disk_t *pdisk);
 
+int disk_sync(struct disk_t *pdisk);
+
 struct volume_t *fat_open(struct disk_t *pdisk, uint32_t first_sector);
 
 int fat_close(struct volume_t *pvolume);
 
+int volume_sync(struct volume_t *pvolume);
+
 struct file_t *file_open(struct volume_t *pvolume, const char *file_name);
 
 int file_close(struct file_t *stream);
 
 size_t file_read(void *ptr, size_t size, size_t nmemb, struct file_t *stream);
 
+size_t file_pread(void *ptr, size_t size, uint32_t offset, const struct file_t *stream);
+
 int32_t file_seek(struct file_t *stream, int32_t offset, int whence);
 
 struct dir_t *dir_open(struct volume_t *pvolume, const char *dir_path);
 
 int dir_read(struct dir_t *pdir, struct dir_entry_t *pentry);
+void make_dir_entry(struct volume_t *pvolume, const struct SFN *entry, uint32_t address, struct dir_entry_t *pentry);
 
 int dir_close(struct dir_t *pdir);
 
+struct recovery_t *recovery_open(struct volume_t *pvolume);
+
+int recovery_read(struct recovery_t *prec, struct deleted_entry_t *pentry);
+
+struct file_t *recovery_file_open(struct volume_t *pvolume, const struct deleted_entry_t *pentry);
+
+int recovery_close(struct recovery_t *prec);
+
+int fat_check(struct volume_t *pvolume, struct check_report_t *report);
+
+//writer
+
+struct file_t *file_create(struct volume_t *pvolume, const char *path);
+
+size_t file_write(const void *ptr, size_t size, size_t nmemb, struct file_t *stream);
+
+int file_truncate(struct file_t *stream, uint32_t length);
+
+int file_delete(struct volume_t *pvolume, const char *path);
+
+//compressed images
+
+int compressed_open(struct disk_t *pdisk);
+
+int compressed_read(struct disk_t *pdisk, int32_t first_sector, void *buffer, int32_t sectors_to_read);
+
+void compressed_close(struct disk_t *pdisk);
+
+uint8_t *get_chunk(struct disk_t *pdisk, uint32_t chunk);
+
+size_t rle_encode(const uint8_t *src, size_t size, uint8_t *dest, size_t dest_size);
+
+int rle_decode(const uint8_t *src, size_t size, uint8_t *dest, size_t dest_size);
+
 //my func
 
 void copy_file(struct SFN *dest, const struct SFN *src);
@@ -147,4 +286,83 @@ int generate_name(const struct SFN *file, char *dest);
 
 int is_name_empty(const char *name);
 
+uint32_t get_root_start(const struct volume_t *pvolume);
+
+uint32_t get_data_start(const struct volume_t *pvolume);
+
+uint32_t get_cluster_count(const struct volume_t *pvolume);
+
+int read_cluster(const struct volume_t *pvolume, uint16_t cluster, void *buffer);
+
+int scan_directory_block(struct recovery_t *prec, const struct SFN *entries, size_t count, uint16_t parent_cluster,
+                         uint16_t *queue, size_t *queue_size, uint8_t *visited);
+
+int bit_test(const uint8_t *bits, uint32_t index);
+
+void bit_set(uint8_t *bits, uint32_t index);
+
+int check_chain(struct volume_t *pvolume, const struct SFN *entry, uint8_t *owned, uint8_t *crossed,
+                struct check_report_t *report);
+
+int check_directory_block(struct volume_t *pvolume, const struct SFN *entries, size_t count, uint16_t *queue,
+                          uint16_t *queue_length, size_t *queue_size, uint8_t *owned, uint8_t *crossed,
+                          struct check_report_t *report);
+
+int compare_first_cluster(const void *a, const void *b);
+
+struct file_t *file_open_path(struct volume_t *pvolume, const char *path);
+
+int is_sfn_char(char c);
+int make_sfn_name(const char *name, char *dest);
+
+uint32_t get_cluster_address(const struct volume_t *pvolume, uint16_t cluster);
+
+int find_entry(struct volume_t *pvolume, uint16_t dir_cluster, const char *sfn_name, struct SFN *entry,
+               uint32_t *address);
+
+int find_free_entry(struct volume_t *pvolume, uint16_t dir_cluster, uint32_t *address);
+
+int lookup_path(struct volume_t *pvolume, const char *path, uint16_t *dir_cluster, char *sfn_name,
+                struct SFN *entry, uint32_t *address);
+
+int write_entry(struct volume_t *pvolume, uint32_t address, const struct SFN *entry);
+
+int build_free_map(struct volume_t *pvolume);
+
+void set_fat_entry(struct volume_t *pvolume, uint16_t cluster, uint16_t value);
+
+//First run of at least `needed` free clusters, or the longest run when none is that long
+size_t find_free_run(const struct volume_t *pvolume, size_t needed, uint16_t *start);
+
+int allocate_clusters(struct volume_t *pvolume, uint16_t last_cluster, size_t count, uint16_t *first_cluster);
+
+void free_chain(struct volume_t *pvolume, uint16_t first_cluster);
+int seek_cluster(struct file_t *stream, uint32_t index, uint16_t *cluster, uint32_t *reached);
+
+int write_fat_copies(struct volume_t *pvolume);
+int fat_flush_allocations(struct volume_t *pvolume);
+int fat_flush(struct volume_t *pvolume);
+
+int volume_read(const struct volume_t *pvolume, uint32_t first_sector, void *buffer, int32_t sectors_to_read);
+
+int volume_write(struct volume_t *pvolume, uint8_t kind, uint32_t first_sector, const void *buffer,
+                 int32_t sectors_to_write);
+
+int volume_write_through(struct volume_t *pvolume, uint32_t first_sector, const void *buffer,
+                         int32_t sectors_to_write);
+
+struct dirty_sector_t *insert_dirty_sector(struct volume_t *pvolume, uint32_t sector);
+
+size_t write_dirty_run(struct disk_t *pdisk, struct dirty_sector_t **sorted, size_t count, char *run);
+
+int volume_flush_data(struct volume_t *pvolume);
+
+struct dirty_sector_t *find_dirty_sector(const struct volume_t *pvolume, uint32_t sector);
+
+int compare_dirty_sectors(const void *a, const void *b);
+
+struct file_t *make_stream(struct volume_t *pvolume, const struct SFN *entry, uint32_t address);
+
+int reconstruct_chains(struct recovery_t *prec);
+
 #endif //FAT_NA_3_FILE_READER_H
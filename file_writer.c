@@ -0,0 +1,604 @@
+//
+// Write support: creating, extending, truncating and deleting files.
+//
+
+#include "file_reader.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+
+
+int find_free_entry(struct volume_t *pvolume, uint16_t dir_cluster, uint32_t *address) {
+
+    if (dir_cluster == 0) {
+        for (int i = 0; i < pvolume->boot_sector->maximum_number_of_files; ++i) {
+            unsigned char first = (unsigned char) pvolume->root[i].filename[0];
+            if (first == 0x00 || first == 0xe5) {
+                *address = get_root_start(pvolume) * 512 + i * sizeof(struct SFN);
+                return 0;
+            }
+        }
+        errno = ENOSPC;
+        return -1;
+    }
+
+    uint16_t *fat = (uint16_t *) pvolume->fat1;
+    uint32_t cluster_count = get_cluster_count(pvolume);
+    size_t cluster_size = pvolume->boot_sector->sectors_per_clusters * 512;
+    size_t entries_per_cluster = cluster_size / sizeof(struct SFN);
+    struct SFN *buffer = calloc(entries_per_cluster, sizeof(struct SFN));
+    if (buffer == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    uint16_t cluster = dir_cluster;
+    for (size_t steps = 0; steps < cluster_count; ++steps) {
+        if (read_cluster(pvolume, cluster, buffer) != 0) {
+            free(buffer);
+            return -1;
+        }
+        for (size_t i = 0; i < entries_per_cluster; ++i) {
+            unsigned char first = (unsigned char) buffer[i].filename[0];
+            if (first == 0x00 || first == 0xe5) {
+                *address = get_cluster_address(pvolume, cluster) + i * sizeof(struct SFN);
+                free(buffer);
+                return 0;
+            }
+        }
+        if (fat[cluster] >= 0xFFF8 || fat[cluster] < 2) {
+            break;
+        }
+        cluster = fat[cluster];
+    }
+
+    //Directory is full: grow it by one zeroed cluster. It is written as data, so the zeroes reach the disk
+    //before the FAT entry that links the cluster into the directory
+    uint16_t new_cluster;
+    if (allocate_clusters(pvolume, cluster, 1, &new_cluster) != 0) {
+        free(buffer);
+        return -1;
+    }
+    memset(buffer, 0, cluster_size);
+    int error = volume_write(pvolume, SECTOR_DATA, get_cluster_address(pvolume, new_cluster) / 512, buffer,
+                             pvolume->boot_sector->sectors_per_clusters);
+    free(buffer);
+    if (error != pvolume->boot_sector->sectors_per_clusters) {
+        int saved_errno = errno;
+        free_chain(pvolume, new_cluster);
+        set_fat_entry(pvolume, cluster, 0xFFFF);
+        errno = saved_errno;
+        return -1;
+    }
+
+    *address = get_cluster_address(pvolume, new_cluster);
+    return 0;
+}
+
+int write_entry(struct volume_t *pvolume, uint32_t address, const struct SFN *entry) {
+
+    char sector[512];
+
+    if (volume_read(pvolume, address / 512, sector, 1) != 1) {
+        return -1;
+    }
+    memcpy(sector + address % 512, entry, sizeof(struct SFN));
+    if (volume_write(pvolume, SECTOR_DIRECTORY, address / 512, sector, 1) != 1) {
+        return -1;
+    }
+
+    uint32_t root_start = get_root_start(pvolume) * 512;
+    uint32_t root_end = root_start + pvolume->boot_sector->maximum_number_of_files * sizeof(struct SFN);
+    if (address >= root_start && address < root_end) {
+        memcpy(&pvolume->root[(address - root_start) / sizeof(struct SFN)], entry, sizeof(struct SFN));
+    }
+
+    return 0;
+}
+
+int build_free_map(struct volume_t *pvolume) {
+
+    uint32_t end = get_cluster_count(pvolume) + 2;
+    uint16_t *fat = (uint16_t *) pvolume->fat1;
+
+    pvolume->free_map = calloc(end / 8 + 1, sizeof(uint8_t));
+    if (pvolume->free_map == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    uint16_t *on_disk = (uint16_t *) pvolume->fat2;
+
+    //Clusters freed since the last flush stay taken until the FAT on disk says so too
+    for (uint32_t cluster = 2; cluster < end; ++cluster) {
+        if (fat[cluster] == 0 && on_disk[cluster] == 0) {
+            bit_set(pvolume->free_map, cluster);
+        }
+    }
+
+    return 0;
+}
+
+void set_fat_entry(struct volume_t *pvolume, uint16_t cluster, uint16_t value) {
+
+    ((uint16_t *) pvolume->fat1)[cluster] = value;
+
+    //fat2 mirrors the FAT on disk; a freed cluster is only reused once that copy is free as well
+    if (pvolume->free_map != NULL) {
+        if (value == 0) {
+            if (((uint16_t *) pvolume->fat2)[cluster] == 0) {
+                bit_set(pvolume->free_map, cluster);
+            }
+        } else {
+            pvolume->free_map[cluster / 8] &= (uint8_t) ~(1 << (cluster % 8));
+        }
+    }
+
+    int32_t sector = cluster * 2 / pvolume->boot_sector->bytes_per_sector;
+    if (pvolume->fat_dirty_first == -1 || sector < pvolume->fat_dirty_first) {
+        pvolume->fat_dirty_first = sector;
+    }
+    if (sector > pvolume->fat_dirty_last) {
+        pvolume->fat_dirty_last = sector;
+    }
+}
+
+size_t find_free_run(const struct volume_t *pvolume, size_t needed, uint16_t *start) {
+
+    uint32_t end = get_cluster_count(pvolume) + 2;
+    size_t best = 0;
+    uint32_t cluster = 2;
+
+    while (cluster < end) {
+        if (cluster % 8 == 0 && pvolume->free_map[cluster / 8] == 0) {
+            cluster += 8;
+            continue;
+        }
+        if (!bit_test(pvolume->free_map, cluster)) {
+            ++cluster;
+            continue;
+        }
+
+        uint32_t first = cluster;
+        while (cluster < end && cluster - first < needed && bit_test(pvolume->free_map, cluster)) {
+            ++cluster;
+        }
+        if (cluster - first > best) {
+            best = cluster - first;
+            *start = (uint16_t) first;
+            if (best == needed) {
+                break;
+            }
+        }
+    }
+
+    return best;
+}
+
+int allocate_clusters(struct volume_t *pvolume, uint16_t last_cluster, size_t count, uint16_t *first_cluster) {
+
+    if (pvolume->free_map == NULL && build_free_map(pvolume) != 0) {
+        return -1;
+    }
+
+    uint32_t end = get_cluster_count(pvolume) + 2;
+    uint16_t previous = last_cluster;
+    uint16_t first = 0;
+
+    while (count > 0) {
+        uint16_t start = 0;
+        size_t length = 0;
+
+        //Extending in place keeps the file contiguous; otherwise take the first run that fits
+        if (previous >= 2 && (uint32_t) previous + 1 < end && bit_test(pvolume->free_map, previous + 1)) {
+            start = previous + 1;
+            while (length < count && start + length < end && bit_test(pvolume->free_map, start + length)) {
+                ++length;
+            }
+        } else {
+            length = find_free_run(pvolume, count, &start);
+        }
+
+        if (length == 0) {
+            if (first != 0) {
+                free_chain(pvolume, first);
+            }
+            if (last_cluster != 0) {
+                set_fat_entry(pvolume, last_cluster, 0xFFFF);
+            }
+            errno = ENOSPC;
+            return -1;
+        }
+
+        for (size_t i = 0; i < length; ++i) {
+            uint16_t cluster = (uint16_t) (start + i);
+            set_fat_entry(pvolume, cluster, 0xFFFF);
+            if (previous != 0) {
+                set_fat_entry(pvolume, previous, cluster);
+            }
+            if (first == 0) {
+                first = cluster;
+            }
+            previous = cluster;
+        }
+        count -= length;
+    }
+
+    *first_cluster = first;
+    return 0;
+}
+
+void free_chain(struct volume_t *pvolume, uint16_t first_cluster) {
+
+    uint16_t *fat = (uint16_t *) pvolume->fat1;
+    uint32_t cluster_count = get_cluster_count(pvolume);
+    uint16_t cluster = first_cluster;
+
+    for (size_t steps = 0; cluster >= 2 && cluster < cluster_count + 2 && steps < cluster_count; ++steps) {
+        uint16_t next = fat[cluster];
+        if (next == 0 || next == 0xFFF7) {
+            break;
+        }
+        set_fat_entry(pvolume, cluster, 0);
+        if (next >= 0xFFF8) {
+            break;
+        }
+        cluster = next;
+    }
+}
+
+struct file_t *file_create(struct volume_t *pvolume, const char *path) {
+    if (pvolume == NULL || path == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    if (!pvolume->disk->is_writable) {
+        errno = EROFS;
+        return NULL;
+    }
+
+    uint16_t dir_cluster;
+    char sfn_name[11];
+    struct SFN entry;
+    uint32_t address;
+
+    int error = lookup_path(pvolume, path, &dir_cluster, sfn_name, &entry, &address);
+    if (error == 0) {
+        errno = EEXIST;
+        return NULL;
+    }
+    if (error == -1) {
+        return NULL;
+    }
+
+    if (find_free_entry(pvolume, dir_cluster, &address) != 0) {
+        return NULL;
+    }
+
+    memset(&entry, 0, sizeof(struct SFN));
+    memcpy(entry.filename, sfn_name, 11);
+    entry.file_attributes = 0x20;
+
+    if (write_entry(pvolume, address, &entry) != 0) {
+        return NULL;
+    }
+
+    return make_stream(pvolume, &entry, address);
+}
+
+//Walks towards the cluster at index, from the stream's remembered position when that is not past it;
+//reached is less than index when the chain ends first. Same bounds as find_entry, a loop or a link
+//out of the data area fails with EIO
+int seek_cluster(struct file_t *stream, uint32_t index, uint16_t *cluster, uint32_t *reached) {
+
+    uint16_t *fat = (uint16_t *) stream->volume->fat1;
+    uint32_t cluster_count = get_cluster_count(stream->volume);
+    uint16_t current = stream->file.low_order_address_of_first_cluster;
+    uint32_t position = 0;
+
+    if (stream->last_cluster != 0 && stream->last_index <= index && fat[stream->last_cluster] != 0) {
+        current = stream->last_cluster;
+        position = stream->last_index;
+    }
+    if (current < 2 || current >= cluster_count + 2) {
+        errno = EIO;
+        return -1;
+    }
+
+    while (position < index && fat[current] < 0xFFF8) {
+        current = fat[current];
+        if (current < 2 || current >= cluster_count + 2 || ++position >= cluster_count) {
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    stream->last_cluster = current;
+    stream->last_index = position;
+    *cluster = current;
+    *reached = position;
+    return 0;
+}
+
+size_t file_write(const void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
+
+    if (ptr == NULL || size <= 0 || nmemb <= 0 || stream == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (stream->entry_address == 0 || stream->chain != NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    if (!stream->volume->disk->is_writable) {
+        errno = EROFS;
+        return -1;
+    }
+
+    struct volume_t *volume = stream->volume;
+    size_t total = size * nmemb;
+    if (total > UINT32_MAX - stream->pos) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    uint32_t cluster_size = stream->bytes_per_sector * stream->sectors_per_clusters;
+    uint32_t end = stream->pos + (uint32_t) total;
+    uint32_t first_index = stream->pos / cluster_size;
+    uint32_t needed = (uint32_t) (((uint64_t) end + cluster_size - 1) / cluster_size);
+    size_t count = needed - first_index;
+
+    //The stream only takes the new entry once it is written, so a failure leaves it untouched
+    struct SFN updated;
+    memcpy(&updated, &stream->file, sizeof(struct SFN));
+    if (end > updated.size) {
+        updated.size = end;
+    }
+
+    //Only the clusters this write touches are collected, starting from the remembered position
+    uint16_t *clusters = calloc(count, sizeof(uint16_t));
+    char *buffer = calloc(cluster_size, sizeof(char));
+    if (clusters == NULL || buffer == NULL) {
+        free(clusters);
+        free(buffer);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    uint16_t *fat = (uint16_t *) volume->fat1;
+    uint32_t cluster_count = get_cluster_count(volume);
+    size_t have = 0;
+    uint16_t last = 0;
+    uint16_t added = 0;
+    int error = 0;
+
+    if (updated.low_order_address_of_first_cluster != 0) {
+        uint16_t cluster;
+        uint32_t reached;
+        if (seek_cluster(stream, first_index, &cluster, &reached) != 0) {
+            error = -1;
+        } else if (reached + 1 < first_index) {
+            //The chain ends before the file does
+            errno = EIO;
+            error = -1;
+        } else {
+            if (reached == first_index) {
+                clusters[have++] = cluster;
+            }
+            while (have < count && fat[cluster] < 0xFFF8) {
+                cluster = fat[cluster];
+                if (cluster < 2 || cluster >= cluster_count + 2 || first_index + have >= cluster_count) {
+                    errno = EIO;
+                    error = -1;
+                    break;
+                }
+                clusters[have++] = cluster;
+            }
+            last = cluster;
+        }
+    }
+
+    if (error == 0 && have < count) {
+        uint16_t first;
+        if (allocate_clusters(volume, last, count - have, &first) != 0) {
+            error = -1;
+        } else {
+            added = first;
+            if (updated.low_order_address_of_first_cluster == 0) {
+                updated.low_order_address_of_first_cluster = added;
+            }
+            //A fresh run from allocate_clusters, so its links are known to be good
+            clusters[have++] = added;
+            while (have < count) {
+                clusters[have] = fat[clusters[have - 1]];
+                ++have;
+            }
+        }
+    }
+
+    const char *source = (const char *) ptr;
+    uint32_t offset = stream->pos;
+    size_t remaining = error == 0 ? total : 0;
+    size_t index = 0;
+
+    while (remaining > 0 && error == 0) {
+        uint32_t inner = offset % cluster_size;
+        size_t length;
+
+        if (inner == 0 && remaining >= cluster_size) {
+            //Whole clusters that are also adjacent on disk are written with a single call, straight to the
+            //disk rather than through the write-back buffer: nothing links them in before the next sync
+            size_t run = 1;
+            while (index + run < count && remaining >= (run + 1) * cluster_size &&
+                   clusters[index + run] == clusters[index + run - 1] + 1) {
+                ++run;
+            }
+            int32_t sectors = (int32_t) (run * stream->sectors_per_clusters);
+            if (volume_write_through(volume, get_cluster_address(volume, clusters[index]) / 512, source,
+                                     sectors) != sectors) {
+                error = -1;
+            }
+            length = run * cluster_size;
+            index += run;
+        } else {
+            length = cluster_size - inner;
+            if (length > remaining) {
+                length = remaining;
+            }
+            if (read_cluster(volume, clusters[index], buffer) != 0) {
+                error = -1;
+                break;
+            }
+            memcpy(buffer + inner, source, length);
+            if (volume_write(volume, SECTOR_DATA, get_cluster_address(volume, clusters[index]) / 512, buffer,
+                             stream->sectors_per_clusters) != stream->sectors_per_clusters) {
+                error = -1;
+            }
+            ++index;
+        }
+
+        offset += length;
+        source += length;
+        remaining -= length;
+    }
+
+    uint16_t tail = count > 0 ? clusters[count - 1] : 0;
+    free(buffer);
+    free(clusters);
+
+    if (error == 0 && write_entry(volume, stream->entry_address, &updated) != 0) {
+        error = -1;
+    }
+
+    if (error != 0) {
+        //Give back the clusters this call added and end the old chain where it ended before
+        if (added != 0) {
+            int saved_errno = errno;
+            free_chain(volume, added);
+            if (last != 0) {
+                set_fat_entry(volume, last, 0xFFFF);
+            }
+            errno = saved_errno;
+            stream->last_cluster = 0;
+        }
+        return -1;
+    }
+
+    memcpy(&stream->file, &updated, sizeof(struct SFN));
+    stream->pos = end;
+    stream->last_cluster = tail;
+    stream->last_index = needed - 1;
+
+    return nmemb;
+}
+
+int file_truncate(struct file_t *stream, uint32_t length) {
+    if (stream == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (stream->entry_address == 0 || stream->chain != NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    if (!stream->volume->disk->is_writable) {
+        errno = EROFS;
+        return -1;
+    }
+    if (length > stream->file.size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct volume_t *volume = stream->volume;
+    uint32_t cluster_size = stream->bytes_per_sector * stream->sectors_per_clusters;
+    size_t keep = (length + cluster_size - 1) / cluster_size;
+    uint16_t first = stream->file.low_order_address_of_first_cluster;
+    uint16_t last = 0;
+    uint16_t tail = 0;
+
+    struct SFN updated;
+    memcpy(&updated, &stream->file, sizeof(struct SFN));
+    updated.size = length;
+
+    if (first != 0) {
+        if (keep == 0) {
+            tail = first;
+            updated.low_order_address_of_first_cluster = 0;
+        } else {
+            uint16_t cluster;
+            uint32_t reached;
+            if (seek_cluster(stream, (uint32_t) keep - 1, &cluster, &reached) != 0) {
+                return -1;
+            }
+            uint16_t next = ((uint16_t *) volume->fat1)[cluster];
+            if (reached == keep - 1 && next < 0xFFF8) {
+                last = cluster;
+                tail = next;
+            }
+        }
+    }
+
+    //The entry goes first; the FAT is only touched once nothing else can fail
+    if (write_entry(volume, stream->entry_address, &updated) != 0) {
+        return -1;
+    }
+    if (last != 0) {
+        set_fat_entry(volume, last, 0xFFFF);
+    }
+    if (tail != 0) {
+        free_chain(volume, tail);
+    }
+
+    memcpy(&stream->file, &updated, sizeof(struct SFN));
+    if (stream->pos > length) {
+        stream->pos = length;
+    }
+    if (stream->last_index >= keep) {
+        stream->last_cluster = 0;
+    }
+
+    return 0;
+}
+
+int file_delete(struct volume_t *pvolume, const char *path) {
+    if (pvolume == NULL || path == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (!pvolume->disk->is_writable) {
+        errno = EROFS;
+        return -1;
+    }
+
+    uint16_t dir_cluster;
+    char sfn_name[11];
+    struct SFN entry;
+    uint32_t address;
+
+    int error = lookup_path(pvolume, path, &dir_cluster, sfn_name, &entry, &address);
+    if (error != 0) {
+        if (error == 1) {
+            errno = ENOENT;
+        }
+        return -1;
+    }
+    if ((entry.file_attributes & 0x10) == 0x10) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    uint16_t first = entry.low_order_address_of_first_cluster;
+    entry.filename[0] = (char) 0xe5;
+
+    if (write_entry(pvolume, address, &entry) != 0) {
+        return -1;
+    }
+    if (first != 0) {
+        free_chain(pvolume, first);
+    }
+
+    return 0;
+}
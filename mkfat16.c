@@ -0,0 +1,588 @@
+//
+// mkfat16: builds a FAT16 image from a host directory tree.
+//
+// usage: mkfat16 [-c sectors_per_cluster] [-s size_in_MiB] <source_dir> <image_file>
+//
+// The whole layout is computed up front (every directory and file gets one contiguous
+// cluster range, assigned in the same order they are written), so the image is produced
+// in a single sequential pass: boot sector, both FATs, root directory, then the data area.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "file_reader.h"
+
+#define ROOT_ENTRIES 512
+#define MIN_CLUSTERS 4085
+#define MAX_CLUSTERS 65524
+#define COPY_BUFFER_SIZE (1024 * 1024)
+#define OUTPUT_BUFFER_SIZE (4 * 1024 * 1024)
+
+struct node_t {
+    char sfn[11];
+    char *path;
+    unsigned int is_directory: 1;
+    uint32_t size;
+    time_t mtime;
+    size_t first_child;
+    size_t child_count;
+    uint16_t first_cluster;
+    uint32_t cluster_count;
+};
+
+struct tree_t {
+    struct node_t *nodes;
+    size_t count;
+    size_t capacity;
+};
+
+int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+//Open-addressed set of the short names used in one directory; next_suffix is only used in the table
+//keyed by BASE and EXT, where it remembers the first ~N not yet tried for that stem
+struct sfn_slot_t {
+    char name[11];
+    uint8_t is_used;
+    uint32_t next_suffix;
+};
+
+struct sfn_set_t {
+    struct sfn_slot_t *slots;
+    size_t capacity; //A power of two, at least twice the names the directory can hold
+};
+
+int sfn_set_init(struct sfn_set_t *set, size_t names) {
+
+    set->capacity = 16;
+    while (set->capacity < 2 * names) {
+        set->capacity *= 2;
+    }
+    set->slots = calloc(set->capacity, sizeof(struct sfn_slot_t));
+
+    return set->slots == NULL ? -1 : 0;
+}
+
+struct sfn_slot_t *find_sfn_slot(const struct sfn_set_t *set, const char *name) {
+
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 11; ++i) {
+        hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+    }
+
+    size_t slot = hash & (set->capacity - 1);
+    while (set->slots[slot].is_used && memcmp(set->slots[slot].name, name, 11) != 0) {
+        slot = (slot + 1) & (set->capacity - 1);
+    }
+
+    return &set->slots[slot];
+}
+
+void take_sfn_slot(struct sfn_slot_t *slot, const char *name) {
+    memcpy(slot->name, name, 11);
+    slot->is_used = 1;
+    slot->next_suffix = 1;
+}
+
+//Names that do not fit 8.3 become BASE~N.EXT, N picked to be unique among the siblings
+int make_unique_sfn(struct sfn_set_t *taken, struct sfn_set_t *stems, const char *name, char *dest) {
+
+    char candidate[11];
+
+    if (make_sfn_name(name, candidate) == 0) {
+        struct sfn_slot_t *slot = find_sfn_slot(taken, candidate);
+        if (!slot->is_used) {
+            take_sfn_slot(slot, candidate);
+            memcpy(dest, candidate, 11);
+            return 0;
+        }
+    }
+
+    char base[9] = {0};
+    char extension[4] = {0};
+    const char *dot = strrchr(name, '.');
+    size_t base_length = 0;
+
+    //Spaces and dots are dropped, anything else a short name cannot hold becomes '_'
+    for (const char *c = name; *c != '\0' && c != dot && base_length < 8; ++c) {
+        if (*c != ' ' && *c != '.') {
+            base[base_length++] = is_sfn_char(*c) ? (char) toupper((unsigned char) *c) : '_';
+        }
+    }
+    for (size_t i = 0; dot != NULL && dot[i + 1] != '\0' && i < 3; ++i) {
+        char c = dot[i + 1];
+        extension[i] = is_sfn_char(c) ? (char) toupper((unsigned char) c) : '_';
+    }
+    if (base_length == 0) {
+        base[base_length++] = '_';
+    }
+
+    //Siblings sharing a stem continue from the last N handed out instead of probing from ~1 again
+    char stem[11];
+    memset(stem, ' ', 11);
+    memcpy(stem, base, base_length);
+    memcpy(stem + 8, extension, strlen(extension));
+    struct sfn_slot_t *counter = find_sfn_slot(stems, stem);
+    if (!counter->is_used) {
+        take_sfn_slot(counter, stem);
+    }
+
+    for (uint32_t n = counter->next_suffix; n < 1000000; ++n) {
+        char suffix[9];
+        size_t suffix_length = (size_t) snprintf(suffix, sizeof(suffix), "~%u", n);
+        size_t keep = base_length + suffix_length > 8 ? 8 - suffix_length : base_length;
+
+        memset(candidate, ' ', 11);
+        memcpy(candidate, base, keep);
+        memcpy(candidate + keep, suffix, suffix_length);
+        memcpy(candidate + 8, extension, strlen(extension));
+
+        struct sfn_slot_t *slot = find_sfn_slot(taken, candidate);
+        if (!slot->is_used) {
+            take_sfn_slot(slot, candidate);
+            counter->next_suffix = n + 1;
+            memcpy(dest, candidate, 11);
+            return 0;
+        }
+    }
+
+    errno = EEXIST;
+    return -1;
+}
+
+struct node_t *add_node(struct tree_t *tree) {
+
+    if (tree->count == tree->capacity) {
+        size_t capacity = tree->capacity == 0 ? 64 : tree->capacity * 2;
+        struct node_t *temp = realloc(tree->nodes, capacity * sizeof(struct node_t));
+        if (temp == NULL) {
+            return NULL;
+        }
+        tree->nodes = temp;
+        tree->capacity = capacity;
+    }
+
+    struct node_t *node = &tree->nodes[tree->count++];
+    memset(node, 0, sizeof(struct node_t));
+
+    return node;
+}
+
+int scan_directory(struct tree_t *tree, size_t index) {
+
+    DIR *dir = opendir(tree->nodes[index].path);
+    if (dir == NULL) {
+        fprintf(stderr, "mkfat16: %s: %s\n", tree->nodes[index].path, strerror(errno));
+        return -1;
+    }
+
+    char **names = NULL;
+    size_t name_count = 0;
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+            continue;
+        }
+        char **temp = realloc(names, (name_count + 1) * sizeof(char *));
+        if (temp == NULL || (temp[name_count] = strdup(dirent->d_name)) == NULL) {
+            free(temp != NULL ? temp : names);
+            closedir(dir);
+            return -1;
+        }
+        names = temp;
+        ++name_count;
+    }
+    closedir(dir);
+
+    //Sorted so the same tree always produces the same image
+    if (name_count > 1) {
+        qsort(names, name_count, sizeof(char *), compare_names);
+    }
+
+    size_t first_child = tree->count;
+    struct sfn_set_t taken = {NULL, 0};
+    struct sfn_set_t stems = {NULL, 0};
+    int error = 0;
+
+    if (sfn_set_init(&taken, name_count) != 0 || sfn_set_init(&stems, name_count) != 0) {
+        error = -1;
+    }
+
+    for (size_t i = 0; i < name_count; ++i) {
+        if (error != 0) {
+            free(names[i]);
+            continue;
+        }
+
+        size_t length = strlen(tree->nodes[index].path) + strlen(names[i]) + 2;
+        char *path = malloc(length);
+        if (path == NULL) {
+            error = -1;
+            free(names[i]);
+            continue;
+        }
+        snprintf(path, length, "%s/%s", tree->nodes[index].path, names[i]);
+
+        struct stat info;
+        if (lstat(path, &info) != 0 || (!S_ISREG(info.st_mode) && !S_ISDIR(info.st_mode))) {
+            fprintf(stderr, "mkfat16: skipping %s\n", path);
+            free(path);
+            free(names[i]);
+            continue;
+        }
+        if (S_ISREG(info.st_mode) && (uint64_t) info.st_size > UINT32_MAX) {
+            fprintf(stderr, "mkfat16: %s: file too large for FAT16\n", path);
+            free(path);
+            free(names[i]);
+            error = -1;
+            continue;
+        }
+
+        struct node_t *node = add_node(tree);
+        if (node == NULL || make_unique_sfn(&taken, &stems, names[i], node->sfn) != 0) {
+            free(path);
+            free(names[i]);
+            error = -1;
+            continue;
+        }
+        node->path = path;
+        node->is_directory = S_ISDIR(info.st_mode) ? 1 : 0;
+        node->size = node->is_directory ? 0 : (uint32_t) info.st_size;
+        node->mtime = info.st_mtime;
+
+        free(names[i]);
+    }
+    free(names);
+    free(taken.slots);
+    free(stems.slots);
+
+    tree->nodes[index].first_child = first_child;
+    tree->nodes[index].child_count = tree->count - first_child;
+
+    return error;
+}
+
+void set_timestamp(struct SFN *entry, time_t mtime) {
+
+    struct tm *local = localtime(&mtime);
+    if (local == NULL || local->tm_year < 80) {
+        return;
+    }
+
+    entry->modified_time.hours = local->tm_hour;
+    entry->modified_time.minutes = local->tm_min;
+    entry->modified_time.seconds = local->tm_sec / 2;
+    entry->modified_date.year = local->tm_year - 80;
+    entry->modified_date.month = local->tm_mon + 1;
+    entry->modified_date.day = local->tm_mday;
+    entry->creation_time = entry->modified_time;
+    entry->creation_date = entry->modified_date;
+}
+
+void fill_entry(struct SFN *entry, const struct node_t *node) {
+
+    memset(entry, 0, sizeof(struct SFN));
+    memcpy(entry->filename, node->sfn, 11);
+    entry->file_attributes = node->is_directory ? 0x10 : 0x20;
+    entry->low_order_address_of_first_cluster = node->first_cluster;
+    entry->size = node->size;
+    set_timestamp(entry, node->mtime);
+}
+
+//Entries of a directory: "." and ".." for subdirectories, then every child
+void fill_directory(const struct tree_t *tree, size_t index, uint16_t parent_cluster, struct SFN *entries) {
+
+    const struct node_t *node = &tree->nodes[index];
+    size_t pos = 0;
+
+    if (index != 0) {
+        fill_entry(&entries[pos], node);
+        memcpy(entries[pos].filename, ".          ", 11);
+        ++pos;
+        fill_entry(&entries[pos], node);
+        memcpy(entries[pos].filename, "..         ", 11);
+        entries[pos].low_order_address_of_first_cluster = parent_cluster;
+        ++pos;
+    }
+
+    for (size_t i = 0; i < node->child_count; ++i) {
+        fill_entry(&entries[pos++], &tree->nodes[node->first_child + i]);
+    }
+}
+
+int write_zeros(FILE *out, uint64_t count) {
+
+    static const char zeros[64 * 1024];
+
+    while (count > 0) {
+        size_t chunk = count > sizeof(zeros) ? sizeof(zeros) : (size_t) count;
+        if (fwrite(zeros, 1, chunk, out) != chunk) {
+            return -1;
+        }
+        count -= chunk;
+    }
+
+    return 0;
+}
+
+int copy_file_data(FILE *out, const struct node_t *node, char *buffer, uint32_t cluster_size) {
+
+    FILE *in = fopen(node->path, "rb");
+    if (in == NULL) {
+        fprintf(stderr, "mkfat16: %s: %s\n", node->path, strerror(errno));
+        return -1;
+    }
+
+    uint32_t remaining = node->size;
+    while (remaining > 0) {
+        size_t chunk = remaining > COPY_BUFFER_SIZE ? COPY_BUFFER_SIZE : remaining;
+        if (fread(buffer, 1, chunk, in) != chunk || fwrite(buffer, 1, chunk, out) != chunk) {
+            fprintf(stderr, "mkfat16: %s: short read or write\n", node->path);
+            fclose(in);
+            return -1;
+        }
+        remaining -= (uint32_t) chunk;
+    }
+    fclose(in);
+
+    return write_zeros(out, (uint64_t) node->cluster_count * cluster_size - node->size);
+}
+
+int main(int argc, char **argv) {
+
+    int sectors_per_cluster = 0;
+    uint64_t requested_size = 0;
+    int option;
+
+    while ((option = getopt(argc, argv, "c:s:")) != -1) {
+        switch (option) {
+            case 'c':
+                sectors_per_cluster = atoi(optarg);
+                break;
+            case 's':
+                requested_size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-c sectors_per_cluster] [-s size_in_MiB] <source_dir> <image_file>\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 2 || (sectors_per_cluster != 0 &&
+                               (sectors_per_cluster > 64 || (sectors_per_cluster & (sectors_per_cluster - 1)) != 0))) {
+        fprintf(stderr, "usage: %s [-c sectors_per_cluster] [-s size_in_MiB] <source_dir> <image_file>\n", argv[0]);
+        return 1;
+    }
+
+    struct tree_t tree = {0};
+    struct node_t *root = add_node(&tree);
+    if (root == NULL || (root->path = strdup(argv[optind])) == NULL) {
+        return 2;
+    }
+    root->is_directory = 1;
+
+    //Breadth-first: the children of every directory end up next to each other in tree.nodes
+    for (size_t i = 0; i < tree.count; ++i) {
+        if (tree.nodes[i].is_directory && scan_directory(&tree, i) != 0) {
+            return 2;
+        }
+    }
+    if (tree.nodes[0].child_count > ROOT_ENTRIES) {
+        fprintf(stderr, "mkfat16: more than %d entries in the root directory\n", ROOT_ENTRIES);
+        return 2;
+    }
+
+    //Pick the smallest cluster that keeps the cluster count within FAT16 limits
+    uint64_t total_clusters = 0;
+    int spc = sectors_per_cluster != 0 ? sectors_per_cluster : 1;
+    while (sectors_per_cluster == 0 && requested_size / 512 / spc > MAX_CLUSTERS && spc < 64) {
+        spc *= 2;
+    }
+    while (1) {
+        uint32_t cluster_size = spc * 512;
+        total_clusters = 0;
+        for (size_t i = 1; i < tree.count; ++i) {
+            struct node_t *node = &tree.nodes[i];
+            uint64_t bytes = node->is_directory ? (node->child_count + 2) * sizeof(struct SFN) : node->size;
+            node->cluster_count = (uint32_t) ((bytes + cluster_size - 1) / cluster_size);
+            total_clusters += node->cluster_count;
+        }
+        if (total_clusters <= MAX_CLUSTERS || sectors_per_cluster != 0 || spc == 64) {
+            break;
+        }
+        spc *= 2;
+    }
+    if (total_clusters > MAX_CLUSTERS) {
+        fprintf(stderr, "mkfat16: %" PRIu64 " clusters do not fit in FAT16\n", total_clusters);
+        return 2;
+    }
+
+    uint32_t root_sectors = ROOT_ENTRIES * sizeof(struct SFN) / 512;
+    uint64_t cluster_count = total_clusters < MIN_CLUSTERS ? MIN_CLUSTERS : total_clusters;
+    uint32_t fat_sectors = 0;
+
+    if (requested_size != 0) {
+        uint64_t total_sectors = requested_size / 512;
+        if (total_sectors < 1 + root_sectors + MIN_CLUSTERS) {
+            fprintf(stderr, "mkfat16: -s too small for the content or for FAT16\n");
+            return 2;
+        }
+        for (int pass = 0; pass < 3; ++pass) {
+            cluster_count = (total_sectors - 1 - 2 * fat_sectors - root_sectors) / spc;
+            fat_sectors = (uint32_t) (((cluster_count + 2) * 2 + 511) / 512);
+        }
+        if (cluster_count < total_clusters || cluster_count < MIN_CLUSTERS) {
+            fprintf(stderr, "mkfat16: -s too small for the content or for FAT16\n");
+            return 2;
+        }
+        if (cluster_count > MAX_CLUSTERS) {
+            fprintf(stderr, "mkfat16: -s too large for FAT16 with this cluster size\n");
+            return 2;
+        }
+    } else {
+        fat_sectors = (uint32_t) (((cluster_count + 2) * 2 + 511) / 512);
+    }
+
+    uint64_t total_sectors = 1 + 2 * (uint64_t) fat_sectors + root_sectors + cluster_count * spc;
+    if (total_sectors > UINT32_MAX) {
+        fprintf(stderr, "mkfat16: image too large\n");
+        return 2;
+    }
+
+    uint32_t cluster_size = spc * 512;
+    uint16_t *fat = calloc(fat_sectors * 256, sizeof(uint16_t));
+    char *buffer = malloc(COPY_BUFFER_SIZE > cluster_size ? COPY_BUFFER_SIZE : cluster_size);
+    struct SFN *root_entries = calloc(ROOT_ENTRIES, sizeof(struct SFN));
+    struct FAT16 *boot_sector = calloc(1, sizeof(struct FAT16));
+    if (fat == NULL || buffer == NULL || root_entries == NULL || boot_sector == NULL) {
+        return 2;
+    }
+
+    //Clusters are handed out in node order, which is also the order the data area is written in
+    fat[0] = 0xFFF8;
+    fat[1] = 0xFFFF;
+    uint32_t cursor = 2;
+    for (size_t i = 1; i < tree.count; ++i) {
+        struct node_t *node = &tree.nodes[i];
+        if (node->cluster_count == 0) {
+            continue;
+        }
+        node->first_cluster = (uint16_t) cursor;
+        for (uint32_t j = 0; j < node->cluster_count - 1; ++j) {
+            fat[cursor + j] = (uint16_t) (cursor + j + 1);
+        }
+        fat[cursor + node->cluster_count - 1] = 0xFFFF;
+        cursor += node->cluster_count;
+    }
+
+    memcpy(boot_sector->unused, "\xEB\x3C\x90", 3);
+    memcpy(boot_sector->name, "MKFAT16 ", 8);
+    boot_sector->bytes_per_sector = 512;
+    boot_sector->sectors_per_clusters = (uint8_t) spc;
+    boot_sector->size_of_reserved_area = 1;
+    boot_sector->number_of_fats = 2;
+    boot_sector->maximum_number_of_files = ROOT_ENTRIES;
+    boot_sector->number_of_sectors = total_sectors <= 0xFFFF ? (uint16_t) total_sectors : 0;
+    boot_sector->media_type = 0xF8;
+    boot_sector->size_of_fat = (uint16_t) fat_sectors;
+    boot_sector->sectors_per_track = 32;
+    boot_sector->number_of_heads = 64;
+    boot_sector->number_of_sectors_in_filesystem = total_sectors <= 0xFFFF ? 0 : (uint32_t) total_sectors;
+    boot_sector->drive_number = 0x80;
+    boot_sector->boot_signature = 0x29;
+    boot_sector->serial_number = (uint32_t) time(NULL);
+    memcpy(boot_sector->label, "NO NAME    ", 11);
+    memcpy(boot_sector->type, "FAT16   ", 8);
+    boot_sector->signature = 0xAA55;
+
+    fill_directory(&tree, 0, 0, root_entries);
+
+    FILE *out = fopen(argv[optind + 1], "wb");
+    if (out == NULL) {
+        fprintf(stderr, "mkfat16: %s: %s\n", argv[optind + 1], strerror(errno));
+        return 2;
+    }
+    setvbuf(out, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+
+    int error = 0;
+    if (fwrite(boot_sector, 512, 1, out) != 1 ||
+        fwrite(fat, 512, fat_sectors, out) != fat_sectors ||
+        fwrite(fat, 512, fat_sectors, out) != fat_sectors ||
+        fwrite(root_entries, 512, root_sectors, out) != root_sectors) {
+        error = -1;
+    }
+
+    //Parents precede their children in node order, so a directory's cluster is known when it is written
+    uint16_t *parent_cluster = calloc(tree.count, sizeof(uint16_t));
+    if (parent_cluster == NULL) {
+        error = -1;
+    }
+    for (size_t i = 0; i < tree.count && error == 0; ++i) {
+        struct node_t *node = &tree.nodes[i];
+        if (node->is_directory) {
+            for (size_t j = 0; j < node->child_count; ++j) {
+                parent_cluster[node->first_child + j] = node->first_cluster;
+            }
+        }
+        if (i == 0 || node->cluster_count == 0) {
+            continue;
+        }
+
+        if (node->is_directory) {
+            struct SFN *entries = calloc(node->cluster_count, cluster_size);
+            if (entries == NULL) {
+                error = -1;
+                break;
+            }
+            fill_directory(&tree, i, parent_cluster[i], entries);
+            if (fwrite(entries, cluster_size, node->cluster_count, out) != node->cluster_count) {
+                error = -1;
+            }
+            free(entries);
+        } else {
+            error = copy_file_data(out, node, buffer, cluster_size);
+        }
+    }
+
+    //Free clusters at the tail: extend the file instead of streaming zeros when possible
+    if (error == 0) {
+        if (fflush(out) != 0 || ftruncate(fileno(out), (off_t) (total_sectors * 512)) != 0) {
+            if (fseeko(out, 0, SEEK_END) != 0 ||
+                write_zeros(out, total_sectors * 512 - (uint64_t) ftello(out)) != 0) {
+                error = -1;
+            }
+        }
+    }
+    if (fclose(out) != 0) {
+        error = -1;
+    }
+
+    if (error != 0) {
+        fprintf(stderr, "mkfat16: failed writing %s\n", argv[optind + 1]);
+    } else {
+        printf("%s: %" PRIu64 " sectors, %u bytes per cluster, %zu entries, %u clusters used\n",
+               argv[optind + 1], total_sectors, cluster_size, tree.count - 1, cursor - 2);
+    }
+
+    for (size_t i = 0; i < tree.count; ++i) {
+        free(tree.nodes[i].path);
+    }
+    free(tree.nodes);
+    free(parent_cluster);
+    free(fat);
+    free(buffer);
+    free(root_entries);
+    free(boot_sector);
+
+    return error == 0 ? 0 : 2;
+}
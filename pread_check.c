@@ -0,0 +1,193 @@
+//
+// pread_check: compares file_pread on an image against the host tree it was built from.
+//
+// usage: pread_check [-n reads_per_file] <image_file> <source_dir>
+//
+// Every regular file whose path is already valid 8.3 is opened on the image and read at
+// random offsets and lengths, including reads that start or run past the end of the file.
+// Files that mkfat16 had to rename (BASE~N.EXT) are skipped. Exits 1 on the first mismatch.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "file_reader.h"
+
+struct check_t {
+    struct volume_t *volume;
+    uint32_t cluster_size;
+    int reads;
+    size_t files_checked;
+    size_t files_skipped;
+};
+
+char *load_file(const char *path, uint32_t *size) {
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    struct stat info;
+    if (fstat(fileno(file), &info) != 0) {
+        fclose(file);
+        return NULL;
+    }
+
+    char *data = malloc(info.st_size > 0 ? (size_t) info.st_size : 1);
+    if (data == NULL || fread(data, 1, (size_t) info.st_size, file) != (size_t) info.st_size) {
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+
+    *size = (uint32_t) info.st_size;
+    return data;
+}
+
+int check_file(struct check_t *check, const char *host_path, const char *image_path) {
+
+    uint32_t size;
+    char *expected = load_file(host_path, &size);
+    if (expected == NULL) {
+        fprintf(stderr, "pread_check: %s: %s\n", host_path, strerror(errno));
+        return -1;
+    }
+
+    struct file_t *stream = file_open_path(check->volume, image_path);
+    if (stream == NULL) {
+        fprintf(stderr, "pread_check: %s: not on the image\n", image_path);
+        free(expected);
+        return -1;
+    }
+    if (stream->file.size != size) {
+        fprintf(stderr, "pread_check: %s: size %u, expected %u\n", image_path, stream->file.size, size);
+        file_close(stream);
+        free(expected);
+        return -1;
+    }
+
+    //Up to four clusters per read, so runs of adjacent clusters and partial heads/tails all get exercised
+    size_t limit = 4 * (size_t) check->cluster_size + 1;
+    char *buffer = malloc(limit);
+    int error = buffer == NULL ? -1 : 0;
+
+    for (int i = 0; i < check->reads && error == 0; ++i) {
+        uint32_t offset = (uint32_t) ((uint64_t) rand() * (uint64_t) rand() % ((uint64_t) size + 16));
+        size_t length = (size_t) rand() % limit;
+        if (i % 8 == 0) {
+            offset -= offset % check->cluster_size;
+        }
+
+        size_t result = file_pread(buffer, length, offset, stream);
+        size_t wanted = offset >= size ? 0 : (length > size - offset ? size - offset : length);
+
+        if (result != wanted || (wanted > 0 && memcmp(buffer, expected + offset, wanted) != 0)) {
+            fprintf(stderr, "pread_check: %s: read of %zu at %u returned %zd, expected %zu bytes\n", image_path,
+                    length, offset, (ssize_t) result, wanted);
+            error = -1;
+        }
+    }
+
+    free(buffer);
+    file_close(stream);
+    free(expected);
+
+    if (error == 0) {
+        ++check->files_checked;
+    }
+    return error;
+}
+
+int check_directory(struct check_t *check, const char *host_path, const char *image_path) {
+
+    DIR *dir = opendir(host_path);
+    if (dir == NULL) {
+        fprintf(stderr, "pread_check: %s: %s\n", host_path, strerror(errno));
+        return -1;
+    }
+
+    int error = 0;
+    struct dirent *dirent;
+    while (error == 0 && (dirent = readdir(dir)) != NULL) {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+            continue;
+        }
+
+        char host_child[4096];
+        char image_child[4096];
+        char sfn_name[11];
+        snprintf(host_child, sizeof(host_child), "%s/%s", host_path, dirent->d_name);
+        snprintf(image_child, sizeof(image_child), "%s/%s", image_path, dirent->d_name);
+
+        struct stat info;
+        if (lstat(host_child, &info) != 0) {
+            continue;
+        }
+        if (make_sfn_name(dirent->d_name, sfn_name) != 0) {
+            ++check->files_skipped;
+            continue;
+        }
+
+        if (S_ISDIR(info.st_mode)) {
+            error = check_directory(check, host_child, image_child);
+        } else if (S_ISREG(info.st_mode)) {
+            error = check_file(check, host_child, image_child);
+        }
+    }
+
+    closedir(dir);
+    return error;
+}
+
+int main(int argc, char **argv) {
+
+    struct check_t check;
+    memset(&check, 0, sizeof(struct check_t));
+    check.reads = 200;
+
+    int option;
+    while ((option = getopt(argc, argv, "n:")) != -1) {
+        switch (option) {
+            case 'n':
+                check.reads = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n reads_per_file] <image_file> <source_dir>\n", argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 2 || check.reads <= 0) {
+        fprintf(stderr, "usage: %s [-n reads_per_file] <image_file> <source_dir>\n", argv[0]);
+        return 1;
+    }
+
+    struct disk_t *disk = disk_open_from_file(argv[optind]);
+    if (disk == NULL) {
+        fprintf(stderr, "pread_check: %s: %s\n", argv[optind], strerror(errno));
+        return 2;
+    }
+    check.volume = fat_open(disk, 0);
+    if (check.volume == NULL) {
+        fprintf(stderr, "pread_check: %s: not a FAT16 volume\n", argv[optind]);
+        disk_close(disk);
+        return 2;
+    }
+    check.cluster_size = check.volume->boot_sector->bytes_per_sector * check.volume->boot_sector->sectors_per_clusters;
+
+    srand(1);
+    int error = check_directory(&check, argv[optind + 1], "");
+
+    printf("%s: %zu files checked, %zu skipped\n", argv[optind], check.files_checked, check.files_skipped);
+
+    fat_close(check.volume);
+    disk_close(disk);
+
+    return error == 0 ? 0 : 1;
+}
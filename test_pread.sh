@@ -0,0 +1,91 @@
+#!/bin/sh
+#
+# Builds images from a generated host tree with mkfat16 (and fat16pack) and checks file_pread
+# against the host files at random offsets with pread_check, then runs write_check on fresh
+# images to exercise the write path under fat_check. When fuse3 and /dev/fuse are
+# available, one image is also mounted with fat16fuse and compared through the kernel.
+#
+# usage: ./test_pread.sh [cc]
+#
+
+set -e
+
+CC=${1:-cc}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# file_reader.c includes the grader's headers; empty ones do outside of it
+for header in tested_declarations.h rdebug.h; do
+    if ! printf '#include "%s"\n' $header | $CC -E -x c - > /dev/null 2>&1; then
+        : > "$WORK/$header"
+    fi
+done
+
+$CC -std=gnu11 -O2 -I"$WORK" -o "$WORK/mkfat16" mkfat16.c file_reader.c
+$CC -std=gnu11 -O2 -I"$WORK" -o "$WORK/fat16pack" fat16pack.c file_reader.c
+$CC -std=gnu11 -O2 -I"$WORK" -o "$WORK/pread_check" pread_check.c file_reader.c
+$CC -std=gnu11 -O2 -I"$WORK" -o "$WORK/write_check" write_check.c file_reader.c file_writer.c
+
+SRC="$WORK/src"
+mkdir -p "$SRC/sub/deeper" "$SRC/empty"
+: > "$SRC/zero.bin"
+for size in 1 511 512 513 2047 2048 2049 65536 100000 1048577; do
+    head -c $size /dev/urandom > "$SRC/r$size.bin"
+done
+head -c 300000 /dev/zero > "$SRC/sub/zeros.bin"
+head -c 70000 /dev/urandom > "$SRC/sub/deeper/data.dat"
+for i in 1 2 3 4 5 6 7 8 9; do
+    head -c $((i * 1000)) /dev/urandom > "$SRC/sub/f$i.txt"
+done
+
+for spc in 1 4 64; do
+    "$WORK/mkfat16" -c $spc "$SRC" "$WORK/c$spc.img"
+    "$WORK/pread_check" "$WORK/c$spc.img" "$SRC"
+    "$WORK/fat16pack" -c 16 "$WORK/c$spc.img" "$WORK/c$spc.f16z"
+    "$WORK/pread_check" "$WORK/c$spc.f16z" "$SRC"
+done
+
+for spc in 1 4; do
+    "$WORK/mkfat16" -c $spc -s 16 "$SRC/sub" "$WORK/w$spc.img"
+    "$WORK/write_check" "$WORK/w$spc.img"
+done
+
+if ! pkg-config --exists fuse3 || [ ! -c /dev/fuse ] || ! command -v fusermount3 > /dev/null; then
+    echo "fuse3 or /dev/fuse not available, skipping the fat16fuse mount test"
+    exit 0
+fi
+
+$CC -std=gnu11 -O2 -I"$WORK" -o "$WORK/fat16fuse" fat16fuse.c file_reader.c $(pkg-config --cflags --libs fuse3)
+
+MNT="$WORK/mnt"
+mkdir "$MNT"
+"$WORK/fat16fuse" "$WORK/c4.img" "$MNT" -f &
+FUSE_PID=$!
+trap 'fusermount3 -u "$MNT" 2> /dev/null; wait $FUSE_PID; rm -rf "$WORK"' EXIT
+
+tries=0
+while [ ! -e "$MNT/ZERO.BIN" ]; do
+    tries=$((tries + 1))
+    if [ $tries -gt 50 ] || ! kill -0 $FUSE_PID 2> /dev/null; then
+        echo "fat16fuse: $WORK/c4.img did not mount" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+# Every host name is valid 8.3, so the mounted path is the host path in upper case
+(cd "$SRC" && find . -type f) | while read -r file; do
+    cmp "$SRC/$file" "$MNT/$(echo "$file" | tr a-z A-Z)"
+done
+
+# Inodes listed by readdir must be the ones getattr reports
+for dir in "$MNT" "$MNT/SUB" "$MNT/SUB/DEEPER"; do
+    ls -i1 "$dir" | while read -r inode name; do
+        if [ "$inode" != "$(stat -c %i "$dir/$name")" ]; then
+            echo "fat16fuse: $dir/$name: readdir inode $inode differs from stat" >&2
+            exit 1
+        fi
+    done
+done
+
+echo "$WORK/c4.img: mounted tree matches"
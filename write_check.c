@@ -0,0 +1,612 @@
+//
+// write_check: exercises the write path on an image and checks the result with fat_check.
+//
+// usage: write_check [-r rounds] <image_file>
+//
+// Every round creates, writes in pieces of random size, overwrites, truncates and deletes files
+// in the root directory while keeping a copy of each in memory, so partial clusters, whole
+// cluster runs and appends all occur. The volume is then closed, reopened read-only and compared
+// with the copies, and fat_check must report nothing. Writes through a read-only open must fail
+// with EROFS, and a write larger than the free space with ENOSPC, leaving the FAT as it was.
+// Finally the FAT is corrupted in memory one way at a time (lost, short, long, cross-linked and
+// invalid chains) and fat_check must count exactly that, and files deleted after a sync must come
+// back byte for byte through recovery_open. The image is modified. Exits 1 on the first failure.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "file_reader.h"
+
+#define FILE_COUNT 24
+#define OPERATIONS_PER_ROUND 200
+
+struct model_t {
+    char path[16];
+    char *data;
+    uint32_t size;
+    int exists;
+};
+
+struct check_t {
+    const char *image;
+    struct disk_t *disk;
+    struct volume_t *volume;
+    uint32_t cluster_size;
+    struct model_t files[FILE_COUNT];
+};
+
+int open_volume(struct check_t *check, int writable) {
+
+    check->disk = writable ? disk_open_from_file_rw(check->image) : disk_open_from_file(check->image);
+    if (check->disk == NULL) {
+        fprintf(stderr, "write_check: %s: %s\n", check->image, strerror(errno));
+        return -1;
+    }
+    check->volume = fat_open(check->disk, 0);
+    if (check->volume == NULL) {
+        fprintf(stderr, "write_check: %s: not a FAT16 volume\n", check->image);
+        disk_close(check->disk);
+        return -1;
+    }
+    check->cluster_size = check->volume->boot_sector->bytes_per_sector *
+                          check->volume->boot_sector->sectors_per_clusters;
+
+    return 0;
+}
+
+int close_volume(struct check_t *check) {
+
+    int error = fat_close(check->volume);
+    if (error != 0) {
+        fprintf(stderr, "write_check: %s: fat_close: %s\n", check->image, strerror(errno));
+    }
+    disk_close(check->disk);
+    check->volume = NULL;
+    check->disk = NULL;
+
+    return error;
+}
+
+size_t count_free_clusters(const struct volume_t *pvolume) {
+
+    const uint16_t *fat = (const uint16_t *) pvolume->fat1;
+    uint32_t end = get_cluster_count(pvolume) + 2;
+    size_t count = 0;
+
+    for (uint32_t cluster = 2; cluster < end; ++cluster) {
+        if (fat[cluster] == 0) {
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+void fill_random(char *buffer, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        buffer[i] = (char) rand();
+    }
+}
+
+//Writes data into the stream at its position in pieces of random length, mirroring them into the model
+int write_pieces(struct check_t *check, struct model_t *model, struct file_t *stream, const char *data,
+                 uint32_t size) {
+
+    uint32_t position = stream->pos;
+    uint32_t done = 0;
+
+    while (done < size) {
+        uint32_t length = (uint32_t) rand() % (2 * check->cluster_size) + 1;
+        if (length > size - done) {
+            length = size - done;
+        }
+        if (file_write(data + done, 1, length, stream) != length) {
+            fprintf(stderr, "write_check: %s: write of %u at %u: %s\n", model->path, length, position + done,
+                    strerror(errno));
+            return -1;
+        }
+        done += length;
+    }
+
+    if (position + size > model->size) {
+        char *temp = realloc(model->data, position + size);
+        if (temp == NULL) {
+            return -1;
+        }
+        model->data = temp;
+        model->size = position + size;
+    }
+    memcpy(model->data + position, data, size);
+
+    return 0;
+}
+
+int change_file(struct check_t *check, struct model_t *model) {
+
+    uint32_t limit = 4 * check->cluster_size + 100;
+    char *data = malloc(limit);
+    if (data == NULL) {
+        return -1;
+    }
+    uint32_t size = (uint32_t) rand() % limit;
+    fill_random(data, size);
+
+    int error = 0;
+    int action = rand() % 4;
+
+    if (!model->exists) {
+        struct file_t *stream = file_create(check->volume, model->path);
+        if (stream == NULL) {
+            fprintf(stderr, "write_check: %s: create: %s\n", model->path, strerror(errno));
+            free(data);
+            return -1;
+        }
+        model->exists = 1;
+        model->size = 0;
+        error = write_pieces(check, model, stream, data, size);
+        file_close(stream);
+    } else if (action == 3) {
+        if (file_delete(check->volume, model->path) != 0) {
+            fprintf(stderr, "write_check: %s: delete: %s\n", model->path, strerror(errno));
+            error = -1;
+        }
+        model->exists = 0;
+        model->size = 0;
+    } else {
+        struct file_t *stream = file_open_path(check->volume, model->path);
+        if (stream == NULL) {
+            fprintf(stderr, "write_check: %s: open: %s\n", model->path, strerror(errno));
+            free(data);
+            return -1;
+        }
+
+        if (action == 0) {
+            //Append
+            file_seek(stream, 0, SEEK_END);
+            error = write_pieces(check, model, stream, data, size);
+        } else if (action == 1) {
+            //Overwrite from a random offset, possibly running past the end
+            uint32_t offset = model->size == 0 ? 0 : (uint32_t) rand() % model->size;
+            if (rand() % 2 == 0) {
+                offset -= offset % check->cluster_size;
+            }
+            file_seek(stream, (int32_t) offset, SEEK_SET);
+            error = write_pieces(check, model, stream, data, size);
+        } else {
+            uint32_t length = model->size == 0 ? 0 : (uint32_t) rand() % (model->size + 1);
+            if (file_truncate(stream, length) != 0) {
+                fprintf(stderr, "write_check: %s: truncate to %u: %s\n", model->path, length, strerror(errno));
+                error = -1;
+            }
+            model->size = length;
+        }
+        file_close(stream);
+    }
+
+    free(data);
+    return error;
+}
+
+int report_is_clean(const char *image, const struct check_report_t *report) {
+
+    if (report->cross_linked_clusters != 0 || report->lost_clusters != 0 || report->lost_chains != 0 ||
+        report->short_chains != 0 || report->long_chains != 0 || report->invalid_references != 0) {
+        fprintf(stderr, "write_check: %s: fat_check: cross %zu, lost %zu in %zu chains, short %zu, long %zu, "
+                        "invalid %zu\n", image, report->cross_linked_clusters, report->lost_clusters,
+                report->lost_chains, report->short_chains, report->long_chains, report->invalid_references);
+        return 0;
+    }
+
+    return 1;
+}
+
+//Compares every file with its model on a read-only open and runs fat_check over the whole volume
+int verify_volume(struct check_t *check) {
+
+    if (open_volume(check, 0) != 0) {
+        return -1;
+    }
+
+    int error = 0;
+    for (int i = 0; i < FILE_COUNT && error == 0; ++i) {
+        struct model_t *model = &check->files[i];
+        struct file_t *stream = file_open_path(check->volume, model->path);
+
+        if (!model->exists) {
+            if (stream != NULL) {
+                fprintf(stderr, "write_check: %s: still there after delete\n", model->path);
+                file_close(stream);
+                error = -1;
+            }
+            continue;
+        }
+        if (stream == NULL) {
+            fprintf(stderr, "write_check: %s: missing\n", model->path);
+            error = -1;
+            break;
+        }
+
+        char *buffer = malloc(model->size + 1);
+        size_t result = buffer == NULL ? 0 : file_read(buffer, 1, model->size + 1, stream);
+        if (stream->file.size != model->size || result != model->size ||
+            (model->size > 0 && memcmp(buffer, model->data, model->size) != 0)) {
+            fprintf(stderr, "write_check: %s: size %u, read %zu, expected %u bytes\n", model->path,
+                    stream->file.size, result, model->size);
+            error = -1;
+        }
+        free(buffer);
+        file_close(stream);
+    }
+
+    struct check_report_t report;
+    if (error == 0 && (fat_check(check->volume, &report) != 0 || !report_is_clean(check->image, &report))) {
+        error = -1;
+    }
+
+    close_volume(check);
+    return error;
+}
+
+//A volume opened read-only must refuse every kind of change
+int check_read_only(struct check_t *check) {
+
+    if (open_volume(check, 0) != 0) {
+        return -1;
+    }
+
+    int error = 0;
+    char byte = 'x';
+
+    errno = 0;
+    if (file_create(check->volume, "/RO.BIN") != NULL || errno != EROFS) {
+        fprintf(stderr, "write_check: file_create on a read-only volume did not fail with EROFS\n");
+        error = -1;
+    }
+    errno = 0;
+    if (file_delete(check->volume, check->files[0].path) == 0 || errno != EROFS) {
+        fprintf(stderr, "write_check: file_delete on a read-only volume did not fail with EROFS\n");
+        error = -1;
+    }
+
+    struct file_t *stream = file_open_path(check->volume, check->files[0].path);
+    if (stream != NULL) {
+        errno = 0;
+        if (file_write(&byte, 1, 1, stream) != (size_t) -1 || errno != EROFS) {
+            fprintf(stderr, "write_check: file_write on a read-only volume did not fail with EROFS\n");
+            error = -1;
+        }
+        errno = 0;
+        if (file_truncate(stream, 0) == 0 || errno != EROFS) {
+            fprintf(stderr, "write_check: file_truncate on a read-only volume did not fail with EROFS\n");
+            error = -1;
+        }
+        file_close(stream);
+    }
+
+    close_volume(check);
+    return error;
+}
+
+//A write the free space cannot hold fails as a whole and gives back what it took
+int check_no_space(struct check_t *check) {
+
+    if (open_volume(check, 1) != 0) {
+        return -1;
+    }
+
+    struct model_t *model = &check->files[0];
+    size_t free_before = count_free_clusters(check->volume);
+    size_t size = (free_before + 1) * check->cluster_size;
+    char *data = calloc(size, sizeof(char));
+    struct file_t *stream = model->exists ? file_open_path(check->volume, model->path) : NULL;
+    int error = 0;
+
+    if (data == NULL || stream == NULL) {
+        fprintf(stderr, "write_check: %s: cannot set up the ENOSPC write\n", model->path);
+        error = -1;
+    } else {
+        file_seek(stream, 0, SEEK_END);
+        errno = 0;
+        if (file_write(data, 1, size, stream) != (size_t) -1 || errno != ENOSPC) {
+            fprintf(stderr, "write_check: %s: write of %zu bytes into %zu free clusters did not fail with ENOSPC\n",
+                    model->path, size, free_before);
+            error = -1;
+        } else if (stream->file.size != model->size || count_free_clusters(check->volume) != free_before) {
+            fprintf(stderr, "write_check: %s: failed write left size %u and %zu free clusters, expected %u and %zu\n",
+                    model->path, stream->file.size, count_free_clusters(check->volume), model->size, free_before);
+            error = -1;
+        }
+    }
+
+    if (stream != NULL) {
+        file_close(stream);
+    }
+    free(data);
+    if (close_volume(check) != 0) {
+        error = -1;
+    }
+
+    return error == 0 ? verify_volume(check) : error;
+}
+
+int expect_report(struct check_t *check, const char *name, const char *saved_fat, size_t cross, size_t lost,
+                  size_t lost_chains, size_t short_chains, size_t long_chains, size_t invalid) {
+
+    struct check_report_t report;
+    int error = fat_check(check->volume, &report);
+
+    if (error == 0 && (report.cross_linked_clusters != cross || report.lost_clusters != lost ||
+                       report.lost_chains != lost_chains || report.short_chains != short_chains ||
+                       report.long_chains != long_chains || report.invalid_references != invalid)) {
+        fprintf(stderr, "write_check: %s: cross %zu, lost %zu in %zu chains, short %zu, long %zu, invalid %zu; "
+                        "expected %zu, %zu in %zu, %zu, %zu, %zu\n", name, report.cross_linked_clusters,
+                report.lost_clusters, report.lost_chains, report.short_chains, report.long_chains,
+                report.invalid_references, cross, lost, lost_chains, short_chains, long_chains, invalid);
+        error = -1;
+    }
+
+    memcpy(check->volume->fat1, saved_fat, (get_cluster_count(check->volume) + 2) * sizeof(uint16_t));
+    return error;
+}
+
+//Breaks the FAT in one way at a time, in memory on a read-only open, and checks fat_check counts exactly that
+int check_corruption(struct check_t *check) {
+
+    if (open_volume(check, 0) != 0) {
+        return -1;
+    }
+
+    uint16_t *fat = (uint16_t *) check->volume->fat1;
+    uint32_t end = get_cluster_count(check->volume) + 2;
+    char *saved = malloc(end * sizeof(uint16_t));
+    struct dir_t *dir = dir_open(check->volume, "\\");
+    if (saved == NULL || dir == NULL) {
+        free(saved);
+        if (dir != NULL) {
+            dir_close(dir);
+        }
+        close_volume(check);
+        return -1;
+    }
+    memcpy(saved, fat, end * sizeof(uint16_t));
+
+    //Root entries are walked in directory order, so A is always reached before B
+    struct dir_entry_t entry;
+    uint16_t a_first = 0;
+    uint16_t b_first = 0;
+    while (dir_read(dir, &entry) == 0 && b_first == 0) {
+        if (entry.is_directory || entry.first_cluster == 0) {
+            continue;
+        }
+        if (a_first == 0 && entry.size > check->cluster_size) {
+            a_first = entry.first_cluster;
+        } else if (a_first != 0) {
+            b_first = entry.first_cluster;
+        }
+    }
+    dir_close(dir);
+
+    uint16_t free_cluster = 0;
+    for (uint32_t cluster = 2; cluster < end && free_cluster == 0; ++cluster) {
+        if (fat[cluster] == 0) {
+            free_cluster = (uint16_t) cluster;
+        }
+    }
+    if (a_first == 0 || b_first == 0 || free_cluster == 0) {
+        fprintf(stderr, "write_check: %s: no two files and free cluster to corrupt\n", check->image);
+        free(saved);
+        close_volume(check);
+        return -1;
+    }
+
+    size_t a_length = 1;
+    uint16_t a_last = a_first;
+    while (fat[a_last] < 0xFFF8) {
+        a_last = fat[a_last];
+        ++a_length;
+    }
+
+    int error = 0;
+
+    fat[free_cluster] = 0xFFFF;
+    error |= expect_report(check, "allocated cluster nothing points to", saved, 0, 1, 1, 0, 0, 0);
+
+    fat[a_first] = 0xFFFF;
+    error |= expect_report(check, "chain cut after its first cluster", saved, 0, a_length - 1, 1, 1, 0, 0);
+
+    fat[a_last] = free_cluster;
+    fat[free_cluster] = 0xFFFF;
+    error |= expect_report(check, "chain extended by a cluster", saved, 0, 0, 0, 0, 1, 0);
+
+    fat[a_last] = b_first;
+    error |= expect_report(check, "chain running into another file", saved, 1, 0, 0, 0, 1, 0);
+
+    fat[a_last] = free_cluster;
+    error |= expect_report(check, "chain running into a free cluster", saved, 0, 0, 0, 0, 0, 1);
+
+    fat[a_last] = (uint16_t) end;
+    error |= expect_report(check, "chain running off the data area", saved, 0, 0, 0, 0, 0, 1);
+
+    free(saved);
+    close_volume(check);
+    return error == 0 ? 0 : -1;
+}
+
+//Files written in one piece get one contiguous run, so once deleted recovery must give them back whole
+int check_recovery(struct check_t *check) {
+
+    const char *paths[] = {"/RA.BIN", "/RB.BIN", "/RC.BIN"};
+    const char *deleted_names[] = {"_A.BIN", "_B.BIN", "_C.BIN"};
+    uint32_t sizes[] = {1, check->cluster_size, 3 * check->cluster_size + 17};
+    char *data[3] = {NULL, NULL, NULL};
+    int error = 0;
+
+    if (open_volume(check, 1) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < 3 && error == 0; ++i) {
+        data[i] = malloc(sizes[i]);
+        struct file_t *stream = data[i] == NULL ? NULL : file_create(check->volume, paths[i]);
+        if (stream == NULL) {
+            fprintf(stderr, "write_check: %s: create: %s\n", paths[i], strerror(errno));
+            error = -1;
+            break;
+        }
+        fill_random(data[i], sizes[i]);
+        if (file_write(data[i], 1, sizes[i], stream) != sizes[i]) {
+            fprintf(stderr, "write_check: %s: write: %s\n", paths[i], strerror(errno));
+            error = -1;
+        }
+        file_close(stream);
+    }
+    //The data has to be on disk before the entries are deleted, as it would be for a real file
+    if (error == 0 && volume_sync(check->volume) != 0) {
+        error = -1;
+    }
+    for (int i = 0; i < 3 && error == 0; ++i) {
+        if (file_delete(check->volume, paths[i]) != 0) {
+            fprintf(stderr, "write_check: %s: delete: %s\n", paths[i], strerror(errno));
+            error = -1;
+        }
+    }
+    if (close_volume(check) != 0) {
+        error = -1;
+    }
+
+    struct recovery_t *recovery = NULL;
+    if (error == 0 && open_volume(check, 0) == 0) {
+        recovery = recovery_open(check->volume);
+        if (recovery == NULL) {
+            fprintf(stderr, "write_check: %s: recovery_open: %s\n", check->image, strerror(errno));
+            error = -1;
+        }
+    } else {
+        error = -1;
+    }
+
+    int found = 0;
+    struct deleted_entry_t entry;
+    while (error == 0 && recovery_read(recovery, &entry) == 0) {
+        int i = 0;
+        while (i < 3 && strcmp(entry.name, deleted_names[i]) != 0) {
+            ++i;
+        }
+        if (i == 3) {
+            continue;
+        }
+        ++found;
+
+        struct file_t *stream = recovery_file_open(check->volume, &entry);
+        if (stream == NULL) {
+            fprintf(stderr, "write_check: %s: recovery_file_open: %s\n", entry.name, strerror(errno));
+            error = -1;
+            break;
+        }
+        char *buffer = malloc(sizes[i] + 1);
+        size_t result = buffer == NULL ? 0 : file_read(buffer, 1, sizes[i] + 1, stream);
+        if (result != sizes[i] || memcmp(buffer, data[i], sizes[i]) != 0) {
+            fprintf(stderr, "write_check: %s: recovered %zu bytes, expected %u\n", entry.name, result, sizes[i]);
+            error = -1;
+        }
+        free(buffer);
+        file_close(stream);
+    }
+    if (error == 0 && found != 3) {
+        fprintf(stderr, "write_check: %s: %d of 3 deleted files found\n", check->image, found);
+        error = -1;
+    }
+
+    if (recovery != NULL) {
+        recovery_close(recovery);
+    }
+    if (check->volume != NULL) {
+        close_volume(check);
+    }
+    for (int i = 0; i < 3; ++i) {
+        free(data[i]);
+    }
+
+    return error;
+}
+
+int main(int argc, char **argv) {
+
+    struct check_t check;
+    memset(&check, 0, sizeof(struct check_t));
+    int rounds = 4;
+
+    int option;
+    while ((option = getopt(argc, argv, "r:")) != -1) {
+        switch (option) {
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-r rounds] <image_file>\n", argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 1 || rounds <= 0) {
+        fprintf(stderr, "usage: %s [-r rounds] <image_file>\n", argv[0]);
+        return 1;
+    }
+    check.image = argv[optind];
+
+    for (int i = 0; i < FILE_COUNT; ++i) {
+        snprintf(check.files[i].path, sizeof(check.files[i].path), "/W%02d.BIN", i);
+    }
+
+    srand(1);
+    int error = 0;
+    for (int round = 0; round < rounds && error == 0; ++round) {
+        if (open_volume(&check, 1) != 0) {
+            return 2;
+        }
+        for (int i = 0; i < OPERATIONS_PER_ROUND && error == 0; ++i) {
+            error = change_file(&check, &check.files[rand() % FILE_COUNT]);
+        }
+        if (close_volume(&check) != 0) {
+            error = -1;
+        }
+        if (error == 0) {
+            error = verify_volume(&check);
+        }
+    }
+
+    //Both need a file that exists; creating it here keeps them independent of the random rounds
+    if (error == 0 && !check.files[0].exists) {
+        error = open_volume(&check, 1);
+        if (error == 0) {
+            error = change_file(&check, &check.files[0]);
+            if (close_volume(&check) != 0) {
+                error = -1;
+            }
+        }
+    }
+    if (error == 0) {
+        error = check_read_only(&check);
+    }
+    if (error == 0) {
+        error = check_no_space(&check);
+    }
+    if (error == 0) {
+        error = check_corruption(&check);
+    }
+    if (error == 0) {
+        error = check_recovery(&check);
+    }
+
+    if (error == 0) {
+        printf("%s: %d rounds of %d changes, fat_check clean\n", check.image, rounds, OPERATIONS_PER_ROUND);
+    }
+
+    for (int i = 0; i < FILE_COUNT; ++i) {
+        free(check.files[i].data);
+    }
+
+    return error == 0 ? 0 : 1;
+}